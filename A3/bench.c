@@ -0,0 +1,980 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "raid.h"
+
+/*
+ * This file implements the benchmarks behind the bench shell command.
+ * Each benchmark runs against the live array through the controller
+ * interface and prints one line of results per configuration it measures.
+ * The benchmarks that write random data to the array save its contents
+ * first and write back the blocks they changed when they finish, so they
+ * can be run on an array that holds data.
+ *
+ * Benchmark options are given as a comma separated list of key=value pairs,
+ * for example "bench rw ops=5000,read=70".
+ *
+ * The hugepage benchmark runs against a private image of size=MB megabytes
+ * instead of the array, so that it measures only the cost of the page size.
+ * The codes benchmark likewise runs the erasure codes on memory buffers of
+ * unit=KB kilobytes per disk.
+ *
+ * The tier benchmark needs an array started with a cache tier (-f).
+ *
+ * The model benchmark compares the predictions of model.c with measured
+ * IOPS, for example "bench model tol=15" after a change to the write path.
+ *
+ * The ipc benchmark compares the transports of -T on channels of its own,
+ * to a process that answers requests the way a disk does without storing
+ * anything, so that only the cost of moving the messages is measured.
+ *
+ * The workload benchmark draws its requests from workload.c, for example
+ * "bench workload dist=zipf,theta=90,seq=10,large=20" for a Zipfian load
+ * with theta 0.90 in which a tenth of the accesses are sequential and a
+ * fifth of the writes cover a whole stripe.
+ */
+
+/* Return the value of key in the option list options, which runs to the
+ * next comma, or NULL if the key is not present.
+ */
+static char *option_value(char *options, const char *key) {
+    if (options == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(key);
+    for (char *p = options; p != NULL; p = strchr(p, ',')) {
+        if (*p == ',') {
+            p++;
+        }
+        if (strncmp(p, key, len) == 0 && p[len] == '=') {
+            return p + len + 1;
+        }
+    }
+    return NULL;
+}
+
+/* Return the integer value of key in the option list options, or def if
+ * the key is not present.
+ */
+static int option_int(char *options, const char *key, int def) {
+    char *value = option_value(options, key);
+    return value != NULL ? atoi(value) : def;
+}
+
+/* Return 1 if key is given the value name in the option list options, or
+ * if the key is not present and name is def, and 0 otherwise.
+ */
+static int option_is(char *options, const char *key, const char *name, const char *def) {
+    char *value = option_value(options, key);
+    if (value == NULL) {
+        return strcmp(name, def) == 0;
+    }
+    size_t len = strlen(name);
+    return strncmp(value, name, len) == 0 && (value[len] == ',' || value[len] == '\0');
+}
+
+// Contents of the array saved before a benchmark that writes to it, and a
+// flag for each block the benchmark has written since
+static char *saved_data;
+static unsigned char *saved_written;
+
+/* Save the contents of every block of the array, so that restore_array can
+ * undo the writes of a benchmark.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int save_array() {
+    int num_blocks = disk_size / block_size;
+    saved_data = malloc((size_t)num_blocks * block_size);
+    saved_written = calloc(num_blocks, 1);
+    if (saved_data == NULL || saved_written == NULL) {
+        fprintf(stderr, "Error: Cannot save the array's data, which the benchmark would overwrite\n");
+        free(saved_data);
+        free(saved_written);
+        saved_data = NULL;
+        saved_written = NULL;
+        return -1;
+    }
+    for (int b = 0; b < num_blocks; b++) {
+        if (read_block(b, saved_data + (size_t)b * block_size) == NULL) {
+            fprintf(stderr, "Error: Cannot save block %d, which the benchmark would overwrite\n", b);
+            free(saved_data);
+            free(saved_written);
+            saved_data = NULL;
+            saved_written = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Write data to block_num for a benchmark, remembering that the block must
+ * be restored.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_write(int block_num, char *data) {
+    if (saved_written != NULL) {
+        saved_written[block_num] = 1;
+    }
+    return write_block(block_num, data);
+}
+
+/* Write back the saved contents of every block written since save_array.
+ *
+ * Returns 0 on success and -1 if a block could not be restored.
+ */
+static int restore_array() {
+    int num_blocks = disk_size / block_size;
+    int status = 0;
+    for (int b = 0; b < num_blocks; b++) {
+        if (saved_written[b] && write_block(b, saved_data + (size_t)b * block_size) != 0) {
+            fprintf(stderr, "Error: Failed to restore block %d after the benchmark\n", b);
+            status = -1;
+        }
+    }
+    free(saved_data);
+    free(saved_written);
+    saved_data = NULL;
+    saved_written = NULL;
+    return status;
+}
+
+/* Issue ops random block reads and writes to the array, of which
+ * read_pct percent are reads, and store the time they took in ms.
+ *
+ * Returns the number of requests that failed, or -1 on failure.
+ */
+static int run_rw(int ops, int read_pct, double *ms) {
+    int num_blocks = disk_size / block_size;
+    char *buf = malloc(block_size);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < block_size; i++) {
+        buf[i] = rand();
+    }
+
+    int errors = 0;
+    double start = monotonic_ms();
+    for (int i = 0; i < ops; i++) {
+        int block_num = rand() % num_blocks;
+        if (rand() % 100 < read_pct) {
+            if (read_block(block_num, buf) == NULL) {
+                errors++;
+            }
+        } else if (bench_write(block_num, buf) != 0) {
+            errors++;
+        }
+    }
+    *ms = monotonic_ms() - start;
+    free(buf);
+    return errors;
+}
+
+/* Issue ops random block reads and writes to the array, of which
+ * read_pct percent are reads, and print the achieved IOPS under label.
+ *
+ * Returns 0 on success and -1 if any request failed.
+ */
+static int bench_rw(const char *label, int ops, int read_pct) {
+    double ms;
+    int errors = run_rw(ops, read_pct, &ms);
+    if (errors == -1) {
+        return -1;
+    }
+
+    printf("bench %-10s %8d ops %3d%% reads %10.1f ms %10.0f IOPS %8.1f us/op",
+           label, ops, read_pct, ms, ms > 0 ? ops * 1000.0 / ms : 0.0, ops > 0 ? ms * 1000.0 / ops : 0.0);
+    if (errors > 0) {
+        printf(" (%d errors)", errors);
+    }
+    printf("\n");
+    return errors > 0 ? -1 : 0;
+}
+
+/* Answer the requests arriving on from_parent, a seqpacket channel if
+ * packets is set, like a disk with no contents: a read is answered with a
+ * block on to_parent and a write is discarded. Exits when the channel is
+ * closed.
+ */
+static void serve_ipc_bench(int from_parent, int to_parent, int packets) {
+    char block[block_size];
+    memset(block, 0, block_size);
+    request_header_t req;
+    while (read_channel(from_parent, &req, sizeof(req), packets) == sizeof(req)) {
+        if (req.cmd == CMD_READ) {
+            if (write_full(to_parent, block, block_size) != block_size) {
+                break;
+            }
+        } else if (read_channel(from_parent, block, block_size, packets) != block_size) {
+            break;
+        }
+    }
+    _exit(0);
+}
+
+/* Measure one transport of kind on a channel to a process answering like a
+ * disk: the time of a read round trip in read_us, and the rate of ops
+ * writes sent one request per call in write_mbps and IPC_BATCH requests per
+ * call in batch_mbps. A write rate includes a read round trip at the end,
+ * which waits for the writes to be taken.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_transport(transport_t kind, int ops, double *read_us, double *write_mbps, double *batch_mbps) {
+    int to_child[2], from_child[2];
+    if (open_channel(kind, to_child, from_child) == -1) {
+        return -1;
+    }
+    int packets = kind == TRANSPORT_SEQPACKET;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(to_child[1]);
+        close(from_child[0]);
+        serve_ipc_bench(to_child[0], from_child[1], packets);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    int out = to_child[1], in = from_child[0];
+
+    char *data = malloc((size_t)IPC_BATCH * block_size);
+    if (data == NULL) {
+        perror("malloc");
+        close(out);
+        close(in);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    memset(data, 0xa5, (size_t)IPC_BATCH * block_size);
+    request_header_t reqs[IPC_BATCH];
+    struct iovec iov[2 * IPC_BATCH];
+    int status = 0;
+
+    // Read round trips, one request in flight at a time
+    request_header_t read_req = { CMD_READ, 0 };
+    double start = monotonic_ms();
+    for (int i = 0; i < ops && status == 0; i++) {
+        if (write_full(out, &read_req, sizeof(read_req)) != sizeof(read_req)
+                || read_full(in, data, block_size) != block_size) {
+            status = -1;
+        }
+    }
+    *read_us = (monotonic_ms() - start) * 1000.0 / ops;
+
+    // Writes one request per call, then IPC_BATCH requests per call
+    for (int batch = 1; batch <= IPC_BATCH && status == 0; batch *= IPC_BATCH) {
+        for (int i = 0; i < batch; i++) {
+            reqs[i].cmd = CMD_WRITE;
+            reqs[i].block_num = i;
+        }
+        start = monotonic_ms();
+        for (int i = 0; i < ops && status == 0; i += batch) {
+            int count = ops - i < batch ? ops - i : batch;
+            for (int j = 0; j < count; j++) {
+                iov[2 * j].iov_base = &reqs[j];
+                iov[2 * j].iov_len = sizeof(reqs[j]);
+                iov[2 * j + 1].iov_base = data + (size_t)j * block_size;
+                iov[2 * j + 1].iov_len = block_size;
+            }
+            status = write_requests(out, iov, count, packets);
+        }
+        if (status == 0 && (write_full(out, &read_req, sizeof(read_req)) != sizeof(read_req)
+                || read_full(in, data, block_size) != block_size)) {
+            status = -1;
+        }
+        double ms = monotonic_ms() - start;
+        double mbps = ms > 0 ? (double)ops * block_size / ms / 1000.0 : 0.0;
+        if (batch == 1) {
+            *write_mbps = mbps;
+        } else {
+            *batch_mbps = mbps;
+        }
+    }
+
+    free(data);
+    close(out);
+    close(in);
+    waitpid(pid, NULL, 0);
+    if (status == -1) {
+        fprintf(stderr, "Error: The ipc benchmark lost its channel\n");
+    }
+    return status;
+}
+
+/* Compare the transports of -T: the latency of a read round trip and the
+ * rate of writes sent one and IPC_BATCH at a time, for ops requests of the
+ * array's block size.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_ipc(int ops) {
+    static const char *labels[] = {"pipe", "seqpacket"};
+    static const transport_t kinds[] = {TRANSPORT_PIPE, TRANSPORT_SEQPACKET};
+    if (block_size > SEQPACKET_MAX_BLOCK) {
+        fprintf(stderr, "Error: Block size must not exceed %d for the ipc benchmark\n", SEQPACKET_MAX_BLOCK);
+        return -1;
+    }
+    printf("bench ipc: %d requests of %d bytes, batches of %d\n", ops, block_size, IPC_BATCH);
+    for (int i = 0; i < 2; i++) {
+        double read_us, write_mbps, batch_mbps;
+        if (bench_transport(kinds[i], ops, &read_us, &write_mbps, &batch_mbps) == -1) {
+            return -1;
+        }
+        printf("  %-10s read round trip %7.2f us  writes %8.1f MB/s  batched writes %8.1f MB/s\n",
+               labels[i], read_us, write_mbps, batch_mbps);
+    }
+    return 0;
+}
+
+/* Compare the IOPS of the array with the processes unpinned, spread over
+ * one core each and colocated on the controller's core. The affinity
+ * selected with -a is restored afterwards.
+ *
+ * Returns 0 on success and -1 if any request failed.
+ */
+static int bench_affinity(int ops, int read_pct) {
+    static const char *labels[] = {"unpinned", "spread", "colocate"};
+    static const affinity_t modes[] = {AFFINITY_NONE, AFFINITY_SPREAD, AFFINITY_COLOCATE};
+    affinity_t saved = affinity;
+    int status = 0;
+
+    for (int i = 0; i < 3; i++) {
+        set_affinity(modes[i]);
+        if (bench_rw(labels[i], ops, read_pct) != 0) {
+            status = -1;
+        }
+    }
+    set_affinity(saved);
+    return status;
+}
+
+/* Copy accesses blocks between random offsets of the size byte region and
+ * a local buffer, the way a disk process serves reads and writes.
+ *
+ * Returns the average time per access in nanoseconds.
+ */
+static double random_block_copies(char *region, size_t size, int accesses) {
+    size_t num_blocks = size / block_size;
+    char buf[block_size];
+    unsigned long long x = 88172645463325252ULL;
+
+    double start = monotonic_ms();
+    for (int i = 0; i < accesses; i++) {
+        // xorshift keeps the generator cost small next to the access
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        char *block = region + (x % num_blocks) * block_size;
+        if (i & 1) {
+            memcpy(block, buf, block_size);
+        } else {
+            memcpy(buf, block, block_size);
+        }
+    }
+    return (monotonic_ms() - start) * 1e6 / accesses;
+}
+
+/* Compare random block accesses to a size_mb megabyte disk image on normal
+ * pages with the same accesses on huge pages, which is dominated by TLB
+ * misses once the image is much larger than the TLB reach.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_hugepage(int ops, int size_mb) {
+    size_t size = (size_t)size_mb << 20;
+    if (size < (size_t)block_size) {
+        fprintf(stderr, "Error: The image must hold at least one block of %d bytes\n", block_size);
+        return -1;
+    }
+
+    char *normal = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (normal == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    madvise(normal, size, MADV_NOHUGEPAGE);
+    memset(normal, 1, size);
+    double normal_ns = random_block_copies(normal, size, ops);
+    munmap(normal, size);
+
+    char *huge = alloc_region(size, 1);
+    if (huge == NULL) {
+        return -1;
+    }
+    memset(huge, 1, size);
+    double huge_ns = random_block_copies(huge, size, ops);
+    free_region(huge, size, 1);
+
+    printf("bench %-10s %8d ops %6d MB image %8.1f ns/op normal pages %8.1f ns/op huge pages %5.2fx speedup\n",
+           "hugepage", ops, size_mb, normal_ns, huge_ns, huge_ns > 0 ? normal_ns / huge_ns : 0.0);
+    return 0;
+}
+
+/* Measure the encode and decode throughput of a k + m code of the given
+ * layout on units of unit_kb kilobytes, encoding about mb megabytes of data.
+ * Decoding rebuilds the first m data units of every stripe, which is the
+ * most expensive recovery the code supports.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_code(const char *label, layout_t code_layout, int k, int m, int unit_kb, int mb) {
+    code_t c;
+    int len = unit_kb * 1024;
+    if (code_layout == LAYOUT_RDP && rdp_prime(k, len) == -1) {
+        fprintf(stderr, "Error: %d KB units do not split into rows for RDP %d+2\n", unit_kb, k);
+        return -1;
+    }
+    if (init_code(&c, code_layout, k, m, k) == -1) {
+        return -1;
+    }
+    char *region = malloc((size_t)(k + m) * len);
+    if (region == NULL) {
+        perror("malloc");
+        free_code(&c);
+        return -1;
+    }
+    char *units[k + m];
+    int present[k + m];
+    for (int i = 0; i < k + m; i++) {
+        units[i] = region + (size_t)i * len;
+    }
+    for (size_t i = 0; i < (size_t)k * len; i++) {
+        region[i] = rand();
+    }
+
+    int stripes = (int)(((long long)mb << 20) / ((long long)k * len));
+    if (stripes < 1) {
+        stripes = 1;
+    }
+
+    double start = monotonic_ms();
+    for (int n = 0; n < stripes; n++) {
+        encode_stripe(&c, units, len);
+    }
+    double encode_ms = monotonic_ms() - start;
+
+    start = monotonic_ms();
+    for (int n = 0; n < stripes; n++) {
+        for (int i = 0; i < k + m; i++) {
+            present[i] = i >= m;
+        }
+        decode_stripe(&c, units, present, len);
+    }
+    double decode_ms = monotonic_ms() - start;
+
+    double data_mb = (double)stripes * k * len / (1 << 20);
+    printf("bench %-10s %3d+%-2d %6d KB units %8.1f MB/s encode %8.1f MB/s decode (%d lost)\n",
+           label, k, m, unit_kb, encode_ms > 0 ? data_mb * 1000 / encode_ms : 0.0,
+           decode_ms > 0 ? data_mb * 1000 / decode_ms : 0.0, m);
+
+    free(region);
+    free_code(&c);
+    return 0;
+}
+
+/* Compare the encode and decode throughput of single XOR parity (RAID 4),
+ * Reed-Solomon with two parities (the P+Q protection of RAID 6) and
+ * row-diagonal parity over the array's data disks, P+Q against row-diagonal
+ * parity on 16 data units, and the wide 8+3 and 10+4 Reed-Solomon codes.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_codes(int unit_kb, int mb) {
+    int status = 0;
+    status |= bench_code("raid4", LAYOUT_RAID4, num_disks, 1, unit_kb, mb);
+    status |= bench_code("rs", LAYOUT_RS, num_disks, 2, unit_kb, mb);
+    status |= bench_code("rdp", LAYOUT_RDP, num_disks, 2, unit_kb, mb);
+    status |= bench_code("rs", LAYOUT_RS, 16, 2, unit_kb, mb);
+    status |= bench_code("rdp", LAYOUT_RDP, 16, 2, unit_kb, mb);
+    status |= bench_code("rs", LAYOUT_RS, 8, 3, unit_kb, mb);
+    status |= bench_code("rs", LAYOUT_RS, 10, 4, unit_kb, mb);
+    return status;
+}
+
+/* Measure single-unit repair for a k + m code of the given layout with local
+ * groups of group data units: the average number of units read to rebuild
+ * one lost unit, and the repair throughput in rebuilt megabytes per second
+ * when every unit of the stripe is lost in turn.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_repair_code(const char *label, layout_t code_layout, int k, int m, int group,
+                             int unit_kb, int mb) {
+    code_t c;
+    int n = k + m;
+    int len = unit_kb * 1024;
+    if (code_layout == LAYOUT_RDP && rdp_prime(k, len) == -1) {
+        fprintf(stderr, "Error: %d KB units do not split into rows for RDP %d+2\n", unit_kb, k);
+        return -1;
+    }
+    if (init_code(&c, code_layout, k, m, group) == -1) {
+        return -1;
+    }
+    char *region = malloc((size_t)n * len);
+    if (region == NULL) {
+        perror("malloc");
+        free_code(&c);
+        return -1;
+    }
+    char *units[n];
+    int failed[n];
+    int needed[n];
+    for (int i = 0; i < n; i++) {
+        units[i] = region + (size_t)i * len;
+        failed[i] = 0;
+    }
+    for (size_t i = 0; i < (size_t)k * len; i++) {
+        region[i] = rand();
+    }
+    encode_stripe(&c, units, len);
+
+    // Each round rebuilds every unit of the stripe once
+    int rounds = (int)(((long long)mb << 20) / ((long long)n * len));
+    if (rounds < 1) {
+        rounds = 1;
+    }
+    long long reads = 0;
+    int status = 0;
+    double start = monotonic_ms();
+    for (int round = 0; round < rounds && status == 0; round++) {
+        for (int target = 0; target < n; target++) {
+            failed[target] = 1;
+            int count = repair_units(&c, target, failed, needed);
+            failed[target] = 0;
+            if (count == -1 || repair_unit(&c, units, needed, target, len) == -1) {
+                status = -1;
+                break;
+            }
+            for (int i = 0; i < n; i++) {
+                reads += needed[i];
+            }
+        }
+    }
+    double ms = monotonic_ms() - start;
+
+    if (status == 0) {
+        double repaired_mb = (double)rounds * n * len / (1 << 20);
+        printf("bench %-6s %3d+%-2d groups of %-3d %5.2f units read per repair %8.1f MB/s repair\n",
+               label, k, m, group, (double)reads / ((long long)rounds * n),
+               ms > 0 ? repaired_mb * 1000 / ms : 0.0);
+    } else {
+        fprintf(stderr, "Error: %s %d+%d could not repair a single unit\n", label, k, m);
+    }
+    free(region);
+    free_code(&c);
+    return status;
+}
+
+/* Compare single-unit repair of Reed-Solomon with two parities (RAID 6) and
+ * row-diagonal parity against an LRC with two local groups and two global
+ * parities over the array's data disks, and the same for the wide 12+4 code
+ * against a 12 data unit LRC in groups of 6.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_repair(int unit_kb, int mb) {
+    int group = (num_disks + 1) / 2;
+    int local = (num_disks + group - 1) / group;
+    int status = 0;
+    status |= bench_repair_code("rs", LAYOUT_RS, num_disks, 2, num_disks, unit_kb, mb);
+    status |= bench_repair_code("rdp", LAYOUT_RDP, num_disks, 2, num_disks, unit_kb, mb);
+    status |= bench_repair_code("lrc", LAYOUT_LRC, num_disks, local + 2, group, unit_kb, mb);
+    status |= bench_repair_code("rs", LAYOUT_RS, 12, 4, 12, unit_kb, mb);
+    status |= bench_repair_code("lrc", LAYOUT_LRC, 12, 4, 6, unit_kb, mb);
+    return status;
+}
+
+/* Compare the array with its cache tier bypassed, with a tier that
+ * promotes every block that misses and with a tier that only promotes hot
+ * extents. Each runs the same ops requests, of which read_pct percent are
+ * reads: scan_pct percent of the requests read the array in order, and the
+ * rest go to random blocks of a hot set half the size of the tier. The
+ * throughput, write latency and tier hit rate of each are printed.
+ *
+ * Returns 0 on success and -1 if any request failed.
+ */
+static int bench_tier(int ops, int read_pct, int scan_pct) {
+    static const char *labels[] = {"capacity", "tier-all", "tier-heat"};
+    int num_blocks = disk_size / block_size;
+    int hot = tier_blocks / 2 > 0 ? tier_blocks / 2 : 1;
+    char *buf = malloc(block_size);
+    if (buf == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < block_size; i++) {
+        buf[i] = rand();
+    }
+
+    int status = 0;
+    for (int pass = 0; pass < 3; pass++) {
+        set_tier_bypass(pass == 0);
+        set_tier_promote_all(pass == 1);
+        reset_tier_stats();
+        srand(1);
+        int errors = 0;
+        int scan = 0;
+        double start = monotonic_ms();
+        for (int i = 0; i < ops; i++) {
+            if (rand() % 100 < scan_pct) {
+                scan = (scan + 1) % num_blocks;
+                if (read_block(scan, buf) == NULL) {
+                    errors++;
+                }
+            } else if (rand() % 100 < read_pct) {
+                if (read_block(rand() % hot, buf) == NULL) {
+                    errors++;
+                }
+            } else if (bench_write(rand() % hot, buf) != 0) {
+                errors++;
+            }
+            tier_idle();
+        }
+        double ms = monotonic_ms() - start;
+        printf("bench %-10s %8d ops %3d%% reads %10.1f ms %10.0f IOPS %8.1f us/op\n",
+               labels[pass], ops, read_pct, ms, ms > 0 ? ops * 1000.0 / ms : 0.0, ms * 1000.0 / ops);
+        print_tier_stats();
+        if (errors > 0) {
+            printf("(%d errors)\n", errors);
+            status = -1;
+        }
+    }
+    set_tier_promote_all(0);
+    free(buf);
+    return status;
+}
+
+/* Compare two counts for qsort, largest first.
+ */
+static int compare_count_desc(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (y > x) - (y < x);
+}
+
+/* Compare two latencies for qsort.
+ */
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Write data to the count blocks of a workload request starting at first.
+ * A request that covers a whole stripe is written as one stripe write, which
+ * computes the parity from the new data without reading the stripe. With a
+ * cache tier every block goes through the tier, which must not be left
+ * holding stale copies.
+ *
+ * Returns the number of blocks that failed.
+ */
+static int workload_write(int first, int count, char *data) {
+    if (tier_enabled() || count != num_disks || first % num_disks != 0) {
+        int errors = 0;
+        for (int b = first; b < first + count; b++) {
+            errors += bench_write(b, data) != 0;
+        }
+        return errors;
+    }
+
+    char *blocks[num_disks];
+    for (int i = 0; i < num_disks; i++) {
+        blocks[i] = data;
+        heat_touch(first + i);
+        if (saved_written != NULL) {
+            saved_written[first + i] = 1;
+        }
+    }
+    double start = monotonic_ms();
+    int status = write_stripe(first / num_disks, blocks);
+    metrics_request(1, num_disks * block_size, monotonic_ms() - start, status != 0);
+    if (status != 0) {
+        return count;
+    }
+    for (int b = first; b < first + count; b++) {
+        replicate_write(b, data);
+    }
+    return 0;
+}
+
+/* Issue ops requests drawn from the workload described by options to the
+ * array and print the achieved IOPS and latency, how skewed the accesses
+ * actually were and, with a cache tier, how well the tier absorbed them.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_workload(char *options, int ops, int read_pct) {
+    static const char *dist_names[] = {"uniform", "zipf", "hotspot"};
+    workload_t w;
+    memset(&w, 0, sizeof(w));
+    if (option_is(options, "dist", "uniform", "zipf")) {
+        w.dist = DIST_UNIFORM;
+    } else if (option_is(options, "dist", "zipf", "zipf")) {
+        w.dist = DIST_ZIPF;
+    } else if (option_is(options, "dist", "hotspot", "zipf")) {
+        w.dist = DIST_HOTSPOT;
+    } else {
+        fprintf(stderr, "Error: dist must be uniform, zipf or hotspot\n");
+        return -1;
+    }
+    w.theta = option_int(options, "theta", 99) / 100.0;
+    w.hot_pct = option_int(options, "hot", 20);
+    w.hot_ops_pct = option_int(options, "hotops", 80);
+    w.seq_pct = option_int(options, "seq", 0);
+    w.streams = option_int(options, "streams", 4);
+    w.read_pct = read_pct;
+    w.large_pct = option_int(options, "large", 0);
+    w.large_blocks = option_int(options, "len", num_disks);
+    w.seed = option_int(options, "seed", 1);
+    int num_blocks = disk_size / block_size;
+    if (init_workload(&w, num_blocks) == -1) {
+        return -1;
+    }
+
+    char *buf = malloc(block_size);
+    int *counts = calloc(num_blocks, sizeof(int));
+    double *latency = malloc(ops * sizeof(double));
+    if (buf == NULL || counts == NULL || latency == NULL) {
+        perror("malloc");
+        free(buf);
+        free(counts);
+        free(latency);
+        return -1;
+    }
+    for (int i = 0; i < block_size; i++) {
+        buf[i] = rand();
+    }
+
+    if (tier_enabled()) {
+        reset_tier_stats();
+    }
+    int errors = 0;
+    long long blocks = 0;
+    double start = monotonic_ms();
+    for (int i = 0; i < ops; i++) {
+        workload_op_t op;
+        next_workload_op(&w, &op);
+        double op_start = monotonic_ms();
+        if (op.write) {
+            errors += workload_write(op.block, op.count, buf);
+        }
+        for (int b = op.block; b < op.block + op.count; b++) {
+            if (!op.write && read_block(b, buf) == NULL) {
+                errors++;
+            }
+            counts[b]++;
+        }
+        latency[i] = monotonic_ms() - op_start;
+        blocks += op.count;
+        tier_idle();
+    }
+    double ms = monotonic_ms() - start;
+
+    qsort(latency, ops, sizeof(double), compare_double);
+    qsort(counts, num_blocks, sizeof(int), compare_count_desc);
+    long long top = 0;
+    for (int i = 0; i < (num_blocks + 9) / 10; i++) {
+        top += counts[i];
+    }
+
+    printf("bench %-10s %8d ops %3d%% reads %10.1f ms %10.0f IOPS %8.1f us/op, p50 %.1f us, p99 %.1f us\n",
+           dist_names[w.dist], ops, read_pct, ms, ms > 0 ? ops * 1000.0 / ms : 0.0, ms * 1000.0 / ops,
+           latency[ops / 2] * 1000.0, latency[(int)(ops * 0.99)] * 1000.0);
+    printf("  %lld blocks accessed, hottest 10%% of blocks took %.1f%% of them, hottest block %d accesses\n",
+           blocks, 100.0 * top / blocks, counts[0]);
+    if (tier_enabled()) {
+        print_tier_stats();
+    }
+    if (errors > 0) {
+        printf("(%d errors)\n", errors);
+    }
+    free(buf);
+    free(counts);
+    free(latency);
+    return errors > 0 ? -1 : 0;
+}
+
+/* Calibrate the performance model on the live array and compare its
+ * predictions with measurements of ops requests at several read ratios
+ * (or only at read=pct if given). A measurement more than tol=pct percent
+ * below the prediction is flagged as a regression, and one more than tol
+ * above it as a sign that the model has gone stale. With disks=, parity=
+ * or lat= describing another array, only the predictions are printed.
+ *
+ * Returns 0 on success and -1 on failure or if a regression was flagged.
+ */
+static int bench_model(char *options, int ops) {
+    static const int read_mix[] = {100, 70, 50, 30, 0};
+    model_t m;
+    if (calibrate_model(&m) == -1) {
+        return -1;
+    }
+    printf("model: %d+%d disks, %d byte blocks, disk %.1f us, read %.2f us, write %.2f us, overhead %.2f us, encode %.2f us\n",
+           m.disks, m.parity, m.block_size, m.disk_us, m.access_us, m.write_access_us, m.overhead_us, m.encode_us);
+
+    int disks = option_int(options, "disks", m.disks);
+    int parity = option_int(options, "parity", m.parity);
+    int lat = option_int(options, "lat", disk_latency_us);
+    int tol = option_int(options, "tol", 20);
+    if (disks <= 0 || parity <= 0 || lat < 0 || tol < 0) {
+        fprintf(stderr, "Error: Invalid benchmark options\n");
+        return -1;
+    }
+    int measure = disks == m.disks && parity == m.parity && lat == disk_latency_us;
+    reshape_model(&m, disks, parity);
+    // The disks oversleep another profile by as much as the live one
+    m.disk_us += lat - disk_latency_us;
+    if (!measure) {
+        printf("model: predicting %d+%d disks with %d us latency, which is not the live array\n", disks, parity, lat);
+    }
+
+    int count = sizeof(read_mix) / sizeof(read_mix[0]);
+    int given = option_int(options, "read", -1);
+    int status = 0;
+    printf("%6s %9s %12s %12s %12s %12s %8s  %s\n",
+           "read%", "disk ops", "pred IOPS", "pred MB/s", "meas IOPS", "meas MB/s", "error", "status");
+    for (int i = 0; i < count; i++) {
+        int read_pct = given >= 0 ? given : read_mix[i];
+        model_prediction_t p;
+        predict_model(&m, read_pct, &p);
+        printf("%6d %9.2f %12.0f %12.2f", read_pct, p.disk_ops, p.iops, p.mbps);
+        if (measure) {
+            double ms;
+            set_tier_bypass(1);
+            srand(1);
+            int errors = run_rw(ops, read_pct, &ms);
+            set_tier_bypass(0);
+            double iops = ms > 0 ? ops * 1000.0 / ms : 0.0;
+            double error = p.iops > 0 ? 100.0 * (iops - p.iops) / p.iops : 0.0;
+            const char *verdict = errors != 0 ? "FAILED" : error < -tol ? "REGRESSION" : error > tol ? "FASTER than model" : "ok";
+            printf(" %12.0f %12.2f %7.1f%%  %s", iops, iops * m.block_size / 1e6, error, verdict);
+            if (errors != 0 || error < -tol) {
+                status = -1;
+            }
+        }
+        printf("\n");
+        if (given >= 0) {
+            break;
+        }
+    }
+    return status;
+}
+
+/* Run the benchmark named kind, which writes random data to the array,
+ * with the key=value list options, and restore the blocks it wrote.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static int run_writing_benchmark(char *kind, char *options, int ops, int read_pct) {
+    if (save_array() == -1) {
+        return -1;
+    }
+    int status;
+    if (strcmp(kind, "rw") == 0) {
+        status = bench_rw("rw", ops, read_pct);
+    } else if (strcmp(kind, "affinity") == 0) {
+        status = bench_affinity(ops, read_pct);
+    } else if (strcmp(kind, "model") == 0) {
+        status = bench_model(options, ops);
+    } else {
+        status = bench_workload(options, ops, read_pct);
+    }
+    if (restore_array() == -1) {
+        status = -1;
+    }
+    return status;
+}
+
+/* Run the benchmark named kind with the key=value list options.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+int run_benchmark(char *kind, char *options) {
+    int ops = option_int(options, "ops", 10000);
+    int read_pct = option_int(options, "read", 50);
+    if (ops <= 0 || read_pct < 0 || read_pct > 100) {
+        fprintf(stderr, "Error: Invalid benchmark options\n");
+        return -1;
+    }
+
+    if (strcmp(kind, "rw") == 0 || strcmp(kind, "affinity") == 0 || strcmp(kind, "model") == 0
+            || strcmp(kind, "workload") == 0) {
+        return run_writing_benchmark(kind, options, ops, read_pct);
+    } else if (strcmp(kind, "hugepage") == 0) {
+        int size_mb = option_int(options, "size", 256);
+        if (size_mb <= 0) {
+            fprintf(stderr, "Error: Invalid benchmark options\n");
+            return -1;
+        }
+        return bench_hugepage(ops, size_mb);
+    } else if (strcmp(kind, "codes") == 0) {
+        int unit_kb = option_int(options, "unit", 64);
+        int mb = option_int(options, "mb", 256);
+        if (unit_kb <= 0 || mb <= 0) {
+            fprintf(stderr, "Error: Invalid benchmark options\n");
+            return -1;
+        }
+        return bench_codes(unit_kb, mb);
+    } else if (strcmp(kind, "repair") == 0) {
+        int unit_kb = option_int(options, "unit", 64);
+        int mb = option_int(options, "mb", 64);
+        if (unit_kb <= 0 || mb <= 0) {
+            fprintf(stderr, "Error: Invalid benchmark options\n");
+            return -1;
+        }
+        return bench_repair(unit_kb, mb);
+    } else if (strcmp(kind, "rebuild") == 0) {
+        // Fail one disk of the running array and time its rebuild
+        int disk = option_int(options, "disk", 0);
+        if (disk < 0 || disk >= num_disks + num_parity) {
+            fprintf(stderr, "Error: Invalid benchmark options\n");
+            return -1;
+        }
+        simulate_disk_failure(disk);
+        return rebuild_disk(disk);
+    } else if (strcmp(kind, "tier") == 0) {
+        int scan_pct = option_int(options, "scan", 20);
+        if (scan_pct < 0 || scan_pct > 100) {
+            fprintf(stderr, "Error: Invalid benchmark options\n");
+            return -1;
+        }
+        if (!tier_enabled()) {
+            fprintf(stderr, "Error: The array has no cache tier\n");
+            return -1;
+        }
+        if (save_array() == -1) {
+            return -1;
+        }
+        int status = bench_tier(ops, read_pct, scan_pct);
+        return restore_array() == -1 ? -1 : status;
+    } else if (strcmp(kind, "ipc") == 0) {
+        return bench_ipc(ops);
+    }
+    fprintf(stderr, "Unknown benchmark: %s\n", kind);
+    return -1;
+}
@@ -10,12 +10,21 @@
  * All of the files in this directory and all subdirectories are:
  * Copyright (c) 2025 Karen Reid
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
 #include "raid.h"
 
 /*
@@ -23,11 +32,116 @@
  * the main RAID simulator and the individual disk processes. It uses pipes
  * for inter-process communication (IPC) and fork to create child processes
  * for each disk.
+ *
+ * When socket_dir is set, each disk process instead listens on a named Unix
+ * socket in that directory and survives the controller. A restarted
+ * controller reattaches to the running disks by checking their superblocks,
+ * so the in-memory disk contents are not lost.
+ *
+ * When disk_binary is set, disks are started with posix_spawn of that
+ * program rather than by forking the controller.
+ *
+ * With the seqpacket transport, each local disk is reached over a
+ * SOCK_SEQPACKET socketpair instead of two pipes. Every request is then one
+ * message, and a rebuild sends the blocks it writes many at a time.
+ *
+ * With the splice transport, the data of a write is handed to the disk's
+ * pipe by vmsplice instead of being copied into it. The pipe then refers to
+ * the caller's buffer, so the disk acknowledges each write once it has
+ * spliced the data out, and the write waits for that before returning.
+ *
+ * When endpoints is set, the disks are raid_disk daemons that were started
+ * separately, and the controller connects to each of them over TCP. Every
+ * request is sent in one write, and the reads of a stripe are all sent
+ * before any reply is awaited, so that network round trips overlap.
+ *
+ * An array with a cache tier has TIER_DISKS more disk processes after the
+ * parity disks. They mirror each other and hold the tier's slots, which
+ * tier.c maps to blocks; only the capacity disks take part in stripes.
+ *
+ * Requests may come from several worker threads at once (-j). Each disk's
+ * lock is held from a request to its reply, so that the replies on a
+ * channel go to the thread that asked for them; a thread that waits on
+ * several disks takes their locks in increasing order. The buffer pool has
+ * a lock of its own.
  */
 
+extern char **environ;
+
 // Global array to store information about each disk's communication pipes.
 static disk_controller_t* controllers;
 
+// Number of disks in a stripe, which come first in the controllers array.
+static int num_controllers;
+
+// Number of entries in the controllers array: the stripe disks followed by
+// the two mirrors of the cache tier, if there is one.
+static int num_channels;
+
+// Erasure code protecting each stripe
+static code_t code;
+
+// Number of blocks read from surviving disks to reconstruct lost blocks
+static long long repair_reads;
+
+// Epoch of the latest checkpoint of the whole array. Every disk stores it
+// with its checkpoint, so that a set taken at different epochs is refused.
+static int epoch;
+
+// Pool of block-sized scratch buffers for parity computation. The pool is
+// allocated once, optionally on huge pages, so that the write path neither
+// calls malloc nor touches fresh pages.
+static char *buffer_pool;
+static char **free_buffers;
+static int num_free_buffers;
+static int pool_size;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Allocate a pool of count scratch buffers of block_size bytes each.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int init_buffer_pool(int count) {
+    buffer_pool = alloc_region((size_t)count * block_size, huge_pages);
+    free_buffers = malloc(count * sizeof(char *));
+    if (buffer_pool == NULL || free_buffers == NULL) {
+        fprintf(stderr, "Failed to allocate buffer pool\n");
+        free_region(buffer_pool, (size_t)count * block_size, huge_pages);
+        free(free_buffers);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        free_buffers[i] = buffer_pool + (size_t)i * block_size;
+    }
+    pool_size = num_free_buffers = count;
+    return 0;
+}
+
+/* Take a scratch buffer from the pool.
+ *
+ * Returns a pointer to a block_size buffer, or NULL if the pool is empty.
+ */
+static char *get_buffer() {
+    char *buf = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (num_free_buffers > 0) {
+        buf = free_buffers[--num_free_buffers];
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return buf;
+}
+
+/* Return buf, which was taken with get_buffer, to the pool.
+ * buf may be NULL, in which case nothing is done.
+ */
+static void put_buffer(char *buf) {
+    if (buf != NULL) {
+        pthread_mutex_lock(&pool_lock);
+        free_buffers[num_free_buffers++] = buf;
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
 /* Ignoring SIGPIPE allows us to check write calls for error rather than
  * terminating the whole system.
  */
@@ -41,6 +155,342 @@ static void ignore_sigpipe() {
     }
 }
 
+/* Mark fd close-on-exec so that disks spawned from disk_binary do not
+ * inherit the controller ends of their siblings' channels.
+ */
+static void set_cloexec(int fd) {
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        perror("fcntl");
+    }
+}
+
+/* Start the num-th disk by spawning disk_binary instead of forking the
+ * controller. posix_spawn does not copy the controller's address space, so
+ * the cost of starting a disk does not grow with the controller's size.
+ *
+ * In pipe mode from_parent and to_parent become the disk's standard input
+ * and output. In socket mode listen_fd is passed as descriptor 3 instead and
+ * the disk is started in a new session.
+ *
+ * Returns the disk's process id on success and -1 on failure.
+ */
+static pid_t spawn_disk(int num, int from_parent, int to_parent, int listen_fd) {
+    char id_arg[16], n_arg[16], b_arg[16], d_arg[16], a_arg[32], m_arg[16], l_arg[16];
+    char g_arg[16], slow_arg[16], fast_arg[16], t_arg[16];
+    snprintf(id_arg, sizeof(id_arg), "%d", num);
+    snprintf(n_arg, sizeof(n_arg), "%d", num_disks);
+    snprintf(b_arg, sizeof(b_arg), "%d", block_size);
+    snprintf(d_arg, sizeof(d_arg), "%d", disk_size);
+    snprintf(a_arg, sizeof(a_arg), "%llx", array_id);
+    snprintf(m_arg, sizeof(m_arg), "%d", num_parity);
+    snprintf(l_arg, sizeof(l_arg), "%d", (int)layout);
+    snprintf(g_arg, sizeof(g_arg), "%d", group_size);
+    snprintf(slow_arg, sizeof(slow_arg), "%d", disk_latency_us);
+    snprintf(fast_arg, sizeof(fast_arg), "%d", fast_latency_us);
+    snprintf(t_arg, sizeof(t_arg), "%d", (int)transport);
+
+    char *argv[32];
+    int argc = 0;
+    argv[argc++] = disk_binary;
+    argv[argc++] = "-i";
+    argv[argc++] = id_arg;
+    argv[argc++] = "-n";
+    argv[argc++] = n_arg;
+    argv[argc++] = "-b";
+    argv[argc++] = b_arg;
+    argv[argc++] = "-d";
+    argv[argc++] = d_arg;
+    argv[argc++] = "-a";
+    argv[argc++] = a_arg;
+    argv[argc++] = "-m";
+    argv[argc++] = m_arg;
+    argv[argc++] = "-l";
+    argv[argc++] = l_arg;
+    argv[argc++] = "-g";
+    argv[argc++] = g_arg;
+    argv[argc++] = "-D";
+    argv[argc++] = slow_arg;
+    argv[argc++] = "-F";
+    argv[argc++] = fast_arg;
+    argv[argc++] = "-T";
+    argv[argc++] = t_arg;
+    if (resume_checkpoints) {
+        argv[argc++] = "-r";
+    }
+    if (huge_pages) {
+        argv[argc++] = "-H";
+    }
+    if (listen_fd != -1) {
+        argv[argc++] = "-s";
+        argv[argc++] = socket_dir;
+    }
+    argv[argc] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    if (listen_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, listen_fd, 3);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+    } else {
+        posix_spawn_file_actions_adddup2(&actions, from_parent, STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, to_parent, STDOUT_FILENO);
+    }
+
+    pid_t pid;
+    int err = posix_spawn(&pid, disk_binary, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "posix_spawn %s: %s\n", disk_binary, strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/* Close the controller ends of every disk channel other than num's, and
+ * those of the replicator's pipes. Called in a newly forked disk process so
+ * that it does not hold descriptors belonging to its siblings.
+ */
+static void close_sibling_channels(int num) {
+    close_replicator_fds();
+    for (int i = 0; i < num_channels; i++) {
+        if (i != num) {
+            if (controllers[i].to_disk[1] != -1) {
+                close(controllers[i].to_disk[1]);
+            }
+            if (controllers[i].from_disk[0] != -1) {
+                close(controllers[i].from_disk[0]);
+            }
+        }
+    }
+}
+
+/* Use the connected stream socket fd as the channel to the num-th disk.
+ * The socket is duplicated so that to_disk[1] and from_disk[0] can be
+ * closed independently, just like the pipe ends they replace.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int attach_socket(int num, int fd) {
+    set_cloexec(fd);
+    int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dup_fd == -1) {
+        perror("dup");
+        close(fd);
+        return -1;
+    }
+    controllers[num].to_disk[0] = -1;
+    controllers[num].to_disk[1] = fd;
+    controllers[num].from_disk[0] = dup_fd;
+    controllers[num].from_disk[1] = -1;
+    return 0;
+}
+
+/* Close the channel to the num-th disk opened by attach_socket.
+ */
+static void detach_socket(int num) {
+    close(controllers[num].to_disk[1]);
+    close(controllers[num].from_disk[0]);
+    controllers[num].to_disk[1] = controllers[num].from_disk[0] = -1;
+}
+
+/* Ask the num-th disk for its superblock and store it in sb.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int identify_disk(int num, superblock_t *sb) {
+    disk_command_t cmd = CMD_IDENTIFY;
+    if (write_full(controllers[num].to_disk[1], &cmd, sizeof(cmd)) != sizeof(cmd)) {
+        fprintf(stderr, "identify_disk: write cmd to disk failed\n");
+        return -1;
+    }
+    if (read_full(controllers[num].from_disk[0], sb, sizeof(*sb)) != sizeof(*sb)) {
+        fprintf(stderr, "identify_disk: read superblock from disk failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Ask the num-th disk, reached at name, for its superblock and check that
+ * it belongs to this array. The first disk to answer sets the array id
+ * when none was given.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int check_superblock(int num, const char *name) {
+    superblock_t sb;
+    if (identify_disk(num, &sb) == -1) {
+        return -1;
+    }
+    if (sb.magic != SUPERBLOCK_MAGIC || sb.disk_id != num || sb.num_disks != num_disks
+            || sb.num_parity != num_parity || sb.layout != (int)layout || sb.group_size != group_size
+            || sb.block_size != block_size || sb.disk_size != disk_size
+            || (array_id != 0 && sb.array_id != array_id)) {
+        fprintf(stderr, "Error: %s belongs to a different array "
+                "(disk %d of %d, block size %d, disk size %d)\n",
+                name, sb.disk_id, sb.num_disks, sb.block_size, sb.disk_size);
+        return -1;
+    }
+
+    array_id = sb.array_id;
+    // The pid of a remote disk belongs to another machine
+    controllers[num].pid = endpoints != NULL ? -1 : sb.pid;
+    controllers[num].child = 0;
+    if (debug) {
+        printf("Attached disk %d (pid %d) of array %016llx\n", num, sb.pid, array_id);
+    }
+    return 0;
+}
+
+/* Try to reattach to a disk process that is still listening on the num-th
+ * disk socket from an earlier run of the controller.
+ *
+ * Returns 0 if the disk was reattached, 1 if no disk is listening on the
+ * socket and -1 if a disk answered but does not belong to this array.
+ */
+static int reattach_disk(int num) {
+    char path[MAX_PATH];
+    if (disk_socket_path(path, sizeof(path), num) == -1) {
+        return -1;
+    }
+
+    int fd = unix_connect(path);
+    if (fd == -1) {
+        if (errno == ECONNREFUSED) {
+            // The disk died and left its socket file behind
+            unlink(path);
+        } else if (errno != ENOENT) {
+            perror("connect");
+            return -1;
+        }
+        return 1;
+    }
+    if (attach_socket(num, fd) == -1) {
+        return -1;
+    }
+    if (check_superblock(num, path) == -1) {
+        detach_socket(num);
+        return -1;
+    }
+    return 0;
+}
+
+/* Store the num-th host:port in the comma separated endpoints list in buf.
+ *
+ * Returns 0 on success and -1 if there is no such endpoint.
+ */
+static int endpoint_of(int num, char *buf, size_t len) {
+    const char *p = endpoints;
+    for (int i = 0; i < num && p != NULL; i++) {
+        p = strchr(p, ',');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    if (p == NULL || *p == '\0') {
+        fprintf(stderr, "Error: No endpoint given for disk %d\n", num);
+        return -1;
+    }
+    size_t n = strcspn(p, ",");
+    if (n >= len) {
+        fprintf(stderr, "Error: Endpoint for disk %d is too long\n", num);
+        return -1;
+    }
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    return 0;
+}
+
+/* Count the endpoints in the comma separated endpoints list.
+ */
+static int count_endpoints() {
+    int count = 1;
+    for (const char *p = endpoints; *p != '\0'; p++) {
+        count += *p == ',';
+    }
+    return count;
+}
+
+/* Connect to the raid_disk daemon serving the num-th disk at its endpoint
+ * and check that it belongs to this array.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int connect_remote_disk(int num) {
+    char endpoint[MAX_PATH];
+    if (endpoint_of(num, endpoint, sizeof(endpoint)) == -1) {
+        return -1;
+    }
+    int fd = tcp_connect(endpoint);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Cannot connect to disk %d at %s: %s\n", num, endpoint, strerror(errno));
+        return -1;
+    }
+    if (attach_socket(num, fd) == -1) {
+        return -1;
+    }
+    if (check_superblock(num, endpoint) == -1) {
+        detach_socket(num);
+        return -1;
+    }
+    return 0;
+}
+
+/* Start the num-th disk as a process listening on its named socket, and
+ * connect to it. The socket is bound before the fork so that the connection
+ * is queued even if the child has not reached accept yet.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int init_socket_disk(int num) {
+    char path[MAX_PATH];
+    if (disk_socket_path(path, sizeof(path), num) == -1) {
+        return -1;
+    }
+
+    int listen_fd = unix_listen(path);
+    if (listen_fd == -1) {
+        return -1;
+    }
+
+    if (disk_binary != NULL) {
+        controllers[num].pid = spawn_disk(num, -1, -1, listen_fd);
+    } else {
+        // Output buffered so far must not be written again by the child
+        fflush(stdout);
+        controllers[num].pid = fork();
+    }
+    if (controllers[num].pid < 0) {
+        perror("fork");
+        close(listen_fd);
+        return -1;
+    }
+    controllers[num].child = 1;
+    if (controllers[num].pid == 0) {
+        close_sibling_channels(num);
+
+        // Leave the controller's session so that the disk is not
+        // killed along with it by the terminal.
+        setsid();
+
+        // Start the disk process
+        if (start_disk_listener(num, listen_fd) != 0) {
+            fprintf(stderr, "Start Disk process failed\n");
+            exit(1);
+        }
+    }
+
+    close(listen_fd);
+    int fd = unix_connect(path);
+    if (fd == -1) {
+        perror("connect");
+        return -1;
+    }
+    return attach_socket(num, fd);
+}
+
 /* Initialize the num-th disk controller, creating pipes to communicate
  * and creating a child process to handle disk requests.
  *
@@ -49,23 +499,36 @@ static void ignore_sigpipe() {
 static int init_disk(int num) {
     ignore_sigpipe();
 
-    // Create pipes for communication with the disk process
-    if (pipe(controllers[num].to_disk) == -1 || pipe(controllers[num].from_disk) == -1) {
-        perror("pipe");
+    if (socket_dir != NULL) {
+        return init_socket_disk(num);
+    }
+
+    // Create the channels for communication with the disk process
+    if (open_channel(transport, controllers[num].to_disk, controllers[num].from_disk) == -1) {
         return -1;
     }
+    set_cloexec(controllers[num].to_disk[1]);
+    set_cloexec(controllers[num].from_disk[0]);
 
-    // Fork a new process fxor the disk
-    controllers[num].pid = fork();
+    // Fork a new process fxor the disk, or spawn one from the disk binary
+    if (disk_binary != NULL) {
+        controllers[num].pid = spawn_disk(num, controllers[num].to_disk[0], controllers[num].from_disk[1], -1);
+    } else {
+        // Output buffered so far must not be written again by the child
+        fflush(stdout);
+        controllers[num].pid = fork();
+    }
     if (controllers[num].pid < 0) {
         perror("fork");
         return -1;
     }
+    controllers[num].child = 1;
     // if in the child process close the unused ends of the pipes
     if (controllers[num].pid == 0) {
         // Child process: close the unused ends of the pipes
         close(controllers[num].to_disk[1]);
         close(controllers[num].from_disk[0]);
+        close_sibling_channels(num);
 
         // Start the disk process
         if (start_disk(num, controllers[num].from_disk[1], controllers[num].to_disk[0]) != 0) {
@@ -93,34 +556,54 @@ static int init_disk(int num) {
 int restart_disk(int num) {
     ignore_sigpipe();
 
-    // Create pipes for communication with the disk process
-    if (pipe(controllers[num].to_disk) == -1 || pipe(controllers[num].from_disk) == -1) {
-        perror("pipe");
+    // A remote disk must be restarted on its own machine; reconnect to it
+    if (endpoints != NULL) {
+        if (controllers[num].to_disk[1] != -1) {
+            detach_socket(num);
+        }
+        return connect_remote_disk(num);
+    }
+    if (socket_dir != NULL) {
+        close(controllers[num].to_disk[1]);
+        close(controllers[num].from_disk[0]);
+        return init_socket_disk(num);
+    }
+
+    // Create the channels for communication with the disk process
+    if (open_channel(transport, controllers[num].to_disk, controllers[num].from_disk) == -1) {
         return -1;
     }
+    set_cloexec(controllers[num].to_disk[1]);
+    set_cloexec(controllers[num].from_disk[0]);
 
-    // Fork a new process for the disk
-    controllers[num].pid = fork();
+    // Fork a new process for the disk, or spawn one from the disk binary
+    if (disk_binary != NULL) {
+        controllers[num].pid = spawn_disk(num, controllers[num].to_disk[0], controllers[num].from_disk[1], -1);
+    } else {
+        // Output buffered so far must not be written again by the child
+        fflush(stdout);
+        controllers[num].pid = fork();
+    }
     if (controllers[num].pid < 0) {
         perror("fork");
         return -1;
     }
+    controllers[num].child = 1;
     if (controllers[num].pid == 0) {
         // for the child process close the unused ends of the pipes
-        for (int i = 0; i < num_disks + 1; i++) {
+        for (int i = 0; i < num_channels; i++) {
             // if this is the disk we are starting at close the other ends of the pipes
             if (i != num) {
                 close(controllers[i].to_disk[1]);
                 close(controllers[i].from_disk[0]);
             }
-            // else close the ends of the pipes that are not used by this disk
+            // else close the parent's ends of this disk's new pipes
             else {
-                close(controllers[i].to_disk[0]);
-                close(controllers[i].from_disk[1]);
                 close(controllers[i].from_disk[0]);
                 close(controllers[i].to_disk[1]);
             }
         }
+        close_replicator_fds();
 
         // Start the disk process
         if (start_disk(num, controllers[num].from_disk[1], controllers[num].to_disk[0]) != 0) {
@@ -136,10 +619,72 @@ int restart_disk(int num) {
     return 0;
 }
 
+/* Wait until every disk is serving requests by asking all of them for their
+ * superblocks before collecting any reply.
+ *
+ * Returns 0 on success and -1 if a disk did not answer.
+ */
+static int wait_for_disks() {
+    disk_command_t cmd = CMD_IDENTIFY;
+    for (int i = 0; i < num_channels; i++) {
+        if (write_full(controllers[i].to_disk[1], &cmd, sizeof(cmd)) != sizeof(cmd)) {
+            fprintf(stderr, "wait_for_disks: write cmd to disk %d failed\n", i);
+            return -1;
+        }
+    }
+    int resumed = -1;
+    for (int i = 0; i < num_channels; i++) {
+        superblock_t sb;
+        if (read_full(controllers[i].from_disk[0], &sb, sizeof(sb)) != sizeof(sb)
+                || sb.magic != SUPERBLOCK_MAGIC || sb.disk_id != i) {
+            fprintf(stderr, "wait_for_disks: disk %d did not identify itself\n", i);
+            return -1;
+        }
+        // Disks started here have loaded their checkpoints, which must all
+        // come from the same epoch; reattached disks kept their live data
+        if (!resume_checkpoints || !controllers[i].child) {
+            continue;
+        }
+        if (resumed == -1) {
+            resumed = i;
+            epoch = sb.epoch;
+        } else if (sb.epoch != epoch) {
+            fprintf(stderr, "Error: Checkpoint of disk %d is from epoch %d, but that of disk %d is from epoch %d\n",
+                    i, sb.epoch, resumed, epoch);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Give up on the disks set up by a failed init_all_controllers. The
+ * channel to every attached disk is closed, so that reattached disks wait
+ * for a new controller, and the disks started here are killed.
+ */
+static void abandon_controllers() {
+    for (int i = 0; i < num_channels; i++) {
+        if (controllers[i].to_disk[1] != -1) {
+            close(controllers[i].to_disk[1]);
+        }
+        if (controllers[i].from_disk[0] != -1) {
+            close(controllers[i].from_disk[0]);
+        }
+        if (controllers[i].child && controllers[i].pid > 0) {
+            kill(controllers[i].pid, SIGKILL);
+            if (waitpid(controllers[i].pid, NULL, 0) == -1 && errno != ECHILD) {
+                perror("abandon_controllers: waitpid");
+            }
+        }
+    }
+    free(controllers);
+    controllers = NULL;
+}
+
 /* Initialize all disk controllers by initializing the controllers
  * array and calling init_disk for each disk.
  *
- * total_disks is the number of data disks + 1 for the parity disk.
+ * total_disks is the number of data disks + the number of parity disks,
+ * plus TIER_DISKS if the array has a cache tier.
  *
  * Returns 0 on success and -1 on failure.
  */
@@ -152,115 +697,687 @@ int init_all_controllers(int total_disks) {
         perror("malloc");
         return -1;
     }
+    num_controllers = num_disks + num_parity;
+    num_channels = total_disks;
+    if (init_code(&code, layout, num_disks, num_parity, group_size) == -1
+            || init_buffer_pool((2 + num_workers) * total_disks + POOL_SPARE_BUFFERS) == -1) {
+        free(controllers);
+        return -1;
+    }
+    for (int i = 0; i < total_disks; i++) {
+        controllers[i].pid = -1;
+        controllers[i].child = 0;
+        controllers[i].failed = 0;
+        pthread_mutex_init(&controllers[i].lock, NULL);
+        controllers[i].to_disk[0] = controllers[i].to_disk[1] = -1;
+        controllers[i].from_disk[0] = controllers[i].from_disk[1] = -1;
+    }
 
-    // Initialize the disk for each controller
+    // Remote disks are already running, so there is nothing to start
+    if (endpoints != NULL) {
+        ignore_sigpipe();
+        if (count_endpoints() != total_disks) {
+            fprintf(stderr, "Error: %d endpoints given for %d disks\n", count_endpoints(), total_disks);
+            abandon_controllers();
+            return -1;
+        }
+        double start = monotonic_ms();
+        for (int i = 0; i < total_disks; i++) {
+            if (connect_remote_disk(i) == -1) {
+                fprintf(stderr, "Connect Disk failed %d\n", i);
+                abandon_controllers();
+                return -1;
+            }
+        }
+        if (debug) {
+            printf("Connected to %d disks in %.1f ms\n", total_disks, monotonic_ms() - start);
+        }
+        return 0;
+    }
+
+    // Reattach to any disks left running by a previous controller before
+    // starting new ones; any disk started next to them is rebuilt below.
+    int reattached = 0;
+    if (socket_dir != NULL) {
+        for (int i = 0; i < total_disks; i++) {
+            int status = reattach_disk(i);
+            if (status == -1) {
+                fprintf(stderr, "Reattach Disk failed %d\n", i);
+                abandon_controllers();
+                return -1;
+            }
+            reattached += status == 0;
+        }
+    }
+    if (array_id == 0) {
+        array_id = ((unsigned long long)time(NULL) << 32) ^ ((unsigned long long)getpid() << 16) ^ (unsigned long long)random();
+    }
+
+    // Initialize the disk for each controller. Disks load their checkpoints
+    // in their own processes, so startup of all disks overlaps.
+    double start = monotonic_ms();
+    int started_here[total_disks];
     for (int i = 0; i < total_disks; i++) {
+        started_here[i] = controllers[i].pid == -1;
+        if (!started_here[i]) {
+            continue;
+        }
         if (init_disk(i) == -1) {
             fprintf(stderr, "Init Disk failed %d\n", i);
-            free(controllers);
+            abandon_controllers();
             return -1;
         }
     }
+    double started = monotonic_ms();
+
+    if (wait_for_disks() == -1) {
+        abandon_controllers();
+        return -1;
+    }
+    if (debug) {
+        printf("Started %d disks in %.1f ms, ready for I/O after %.1f ms\n",
+               total_disks, started - start, monotonic_ms() - start);
+    }
+    for (int i = 0; i < total_disks; i++) {
+        perf_attach_disk(i, controllers[i].pid);
+    }
+
+    // A disk started next to reattached ones is empty or holds an older
+    // checkpoint, so it is rebuilt from the live disks before any I/O
+    if (reattached > 0 && reattached < total_disks) {
+        for (int i = 0; i < total_disks; i++) {
+            if (started_here[i]) {
+                fprintf(stderr, "Disk %d did not reattach, rebuilding it\n", i);
+                controllers[i].failed = 1;
+                metrics_disk_failed(i, 1);
+            }
+        }
+        for (int i = 0; i < total_disks; i++) {
+            if (started_here[i] && rebuild_disk(i) == -1) {
+                fprintf(stderr, "Error: Cannot rebuild disk %d from the reattached disks\n", i);
+                abandon_controllers();
+                return -1;
+            }
+        }
+    }
     return 0;
 }
 
-/* Read the block of data at block_num from the appropriate disk.
- * The block is stored to the memory pointed to by data.
+/* Send a request for the block at stripe to the disk disk_num without
+ * waiting for the reply, so that requests to several disks are in flight
+ * at once. The command and block number go out in a single write.
  *
- * If parity_flag == 1, read from parity disk.
- * If parity_flag == 0, read from data disk.
+ * Returns 0 on success and -1 on failure.
+ */
+static int send_read_request(int disk_num, int stripe) {
+    // Each disk has a linear array of blocks, so the block number on an
+    // individual disk is the same as the stripe number
+    request_header_t req = { CMD_READ, stripe };
+    if (write_full(controllers[disk_num].to_disk[1], &req, sizeof(req)) != sizeof(req)) {
+        fprintf(stderr, "send_read_request: write request to disk %d failed\n", disk_num);
+        return -1;
+    }
+    metrics_disk_send(disk_num, 0);
+    flight_record(FLIGHT_SEND_READ, disk_num, stripe, -1);
+    return 0;
+}
+
+/* Receive the reply to a read request from the disk disk_num into the
+ * memory pointed to by data.
  *
  * Returns 0 on success and -1 on failure.
  */
-int read_block_from_disk(int block_num, char* data, int parity_flag) {
+static int receive_block(int disk_num, char *data) {
+    metrics_disk_reply(disk_num);
+    if (read_full(controllers[disk_num].from_disk[0], data, block_size) != block_size) {
+        fprintf(stderr, "receive_block: read data from disk %d failed\n", disk_num);
+        flight_record(FLIGHT_REPLY, disk_num, -1, -1);
+        return -1;
+    }
+    flight_record(FLIGHT_REPLY, disk_num, -1, 0);
+    return 0;
+}
+
+/* Read the block of data at stripe from the disk disk_num.
+ * The block is stored to the memory pointed to by data.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int read_block_from_disk(int disk_num, int stripe, char* data) {
     if (!data) {
         fprintf(stderr, "Error: Invalid data buffer\n");
         return -1;
     }
+    pthread_mutex_lock(&controllers[disk_num].lock);
+    int status = send_read_request(disk_num, stripe);
+    if (status == 0) {
+        status = receive_block(disk_num, data);
+    }
+    pthread_mutex_unlock(&controllers[disk_num].lock);
+    return status;
+}
 
-    // Identify the stripe to read from
-    int disk_num;
-    if (parity_flag == 1) {
-        disk_num = num_disks;
+/* Send the write request req for the block at data to the disk disk_num,
+ * moving the data with vmsplice, and wait for the disk to acknowledge that
+ * it has taken the data out of the pipe, after which data may change. The
+ * disk's lock must be held.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int splice_block_to_disk(int disk_num, request_header_t *req, char *data) {
+    int ack;
+    if (write_full(controllers[disk_num].to_disk[1], req, sizeof(*req)) != sizeof(*req)
+            || vmsplice_full(controllers[disk_num].to_disk[1], data, block_size) != block_size
+            || read_full(controllers[disk_num].from_disk[0], &ack, sizeof(ack)) != sizeof(ack)) {
+        return -1;
+    }
+    return ack == req->block_num ? 0 : -1;
+}
+
+/* Write a block of data to the block at stripe on the disk disk_num.
+ * The block is stored at the memory pointed to by data. The request and
+ * the data are sent together, so a remote disk receives them in as few
+ * segments as possible.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_block_to_disk(int disk_num, int stripe, char *data) {
+    if (data == NULL) {
+        fprintf(stderr, "Invalid data buffer\n");
+        return -1;
+    }
+
+    request_header_t req = { CMD_WRITE, stripe };
+    struct iovec iov[2] = {
+        { &req, sizeof(req) },
+        { data, block_size }
+    };
+    pthread_mutex_lock(&controllers[disk_num].lock);
+    int status;
+    if (transport == TRANSPORT_SPLICE) {
+        status = splice_block_to_disk(disk_num, &req, data);
     } else {
-        disk_num = block_num % num_disks;
+        status = writev_full(controllers[disk_num].to_disk[1], iov, 2) == (ssize_t)(sizeof(req) + block_size) ? 0 : -1;
     }
+    pthread_mutex_unlock(&controllers[disk_num].lock);
+    if (status == -1) {
+        fprintf(stderr, "write_block_to_disk: write request to disk %d failed\n", disk_num);
+        return -1;
+    }
+    metrics_disk_send(disk_num, 1);
+    flight_record(FLIGHT_SEND_WRITE, disk_num, stripe, -1);
+    return 0;
+}
 
-    disk_command_t cmd = CMD_READ;
+/* Write the count blocks in data, which follow each other, to the stripes
+ * starting at first on the disk disk_num. The requests are written
+ * together, in a single sendmmsg call per IPC_BATCH requests on a seqpacket
+ * channel. count must not exceed IPC_BATCH.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_blocks_to_disk(int disk_num, int first, int count, char *data) {
+    // Spliced writes are acknowledged one at a time
+    if (transport == TRANSPORT_SPLICE) {
+        for (int i = 0; i < count; i++) {
+            if (write_block_to_disk(disk_num, first + i, data + (size_t)i * block_size) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+    request_header_t req[IPC_BATCH];
+    struct iovec iov[2 * IPC_BATCH];
+    for (int i = 0; i < count; i++) {
+        req[i].cmd = CMD_WRITE;
+        req[i].block_num = first + i;
+        iov[2 * i].iov_base = &req[i];
+        iov[2 * i].iov_len = sizeof(req[i]);
+        iov[2 * i + 1].iov_base = data + (size_t)i * block_size;
+        iov[2 * i + 1].iov_len = block_size;
+    }
+    pthread_mutex_lock(&controllers[disk_num].lock);
+    int status = write_requests(controllers[disk_num].to_disk[1], iov, count, transport == TRANSPORT_SEQPACKET);
+    pthread_mutex_unlock(&controllers[disk_num].lock);
+    if (status == -1) {
+        fprintf(stderr, "write_blocks_to_disk: write requests to disk %d failed\n", disk_num);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        metrics_disk_send(disk_num, 1);
+        flight_record(FLIGHT_SEND_WRITE, disk_num, first + i, -1);
+    }
+    return 0;
+}
 
-    // Each disk has a linear array of blocks, so the block number on an
-    // individual disk is the same as the stripe number
-    block_num = block_num / num_disks;
+/* Record that the disk disk_num has failed. Its blocks are reconstructed
+ * from the rest of their stripe until it is rebuilt. The flight recorder is
+ * dumped, since the requests leading up to the failure are what explain it.
+ */
+static void mark_disk_failed(int disk_num) {
+    if (!controllers[disk_num].failed) {
+        fprintf(stderr, "Disk %d has failed, running degraded\n", disk_num);
+        controllers[disk_num].failed = 1;
+        metrics_disk_failed(disk_num, 1);
+        flight_record(FLIGHT_DISK_FAILED, disk_num, -1, -1);
+        flight_dump("disk failure detected");
+    }
+}
 
-    // Write the command and the block number to the disk process
-    // Then read the block from the disk process
+/* Read the units of stripe that have want[i] set and are not yet present
+ * into units, marking disks that do not answer as failed. All the requests
+ * are sent before any reply is read, so the disks serve them in parallel.
+ *
+ * Returns the number of units read.
+ */
+static int read_units(int stripe, const int *want, char **units, int *present) {
+    int locked[num_controllers];
+    int sent[num_controllers];
+    for (int i = 0; i < num_controllers; i++) {
+        sent[i] = 0;
+        locked[i] = want[i] && !present[i] && !controllers[i].failed;
+        if (locked[i]) {
+            pthread_mutex_lock(&controllers[i].lock);
+            if (send_read_request(i, stripe) == 0) {
+                sent[i] = 1;
+            } else {
+                mark_disk_failed(i);
+            }
+        }
+    }
 
-    // Write cmd to the disk process
-    if (write(controllers[disk_num].to_disk[1], &cmd, sizeof(cmd)) != sizeof(cmd)) {
-        fprintf(stderr, "read_block_from_disk: write cmd to disk failed\n");
-        return -1;
+    int count = 0;
+    for (int i = 0; i < num_controllers; i++) {
+        if (sent[i]) {
+            if (receive_block(i, units[i]) == 0) {
+                present[i] = 1;
+                count++;
+            } else {
+                mark_disk_failed(i);
+            }
+        }
+        if (locked[i]) {
+            pthread_mutex_unlock(&controllers[i].lock);
+        }
     }
+    return count;
+}
 
-    // Write block_num to the disk process
-    if (write(controllers[disk_num].to_disk[1], &block_num, sizeof(block_num)) != sizeof(block_num)) {
-        fprintf(stderr, "read_block_from_disk: write block num to disk failed\n");
-        return -1;
+/* Take one scratch buffer per disk for the units of a stripe, with none of
+ * them marked as present.
+ *
+ * Returns 0 on success and -1 if the pool is exhausted.
+ */
+static int get_stripe_buffers(char **units, int *present) {
+    for (int i = 0; i < num_controllers; i++) {
+        units[i] = get_buffer();
+        present[i] = 0;
+        if (units[i] == NULL) {
+            fprintf(stderr, "Error: buffer pool exhausted\n");
+            while (i-- > 0) {
+                put_buffer(units[i]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Return the scratch buffers of a stripe to the pool.
+ */
+static void put_stripe_buffers(char **units) {
+    for (int i = num_controllers - 1; i >= 0; i--) {
+        put_buffer(units[i]);
     }
+}
 
-    // Read block data from the disk process
-    if (read(controllers[disk_num].from_disk[0], data, block_size) != block_size) {
-        fprintf(stderr, "read_block_from_disk: read data from disk failed\n");
+/* Bring the units of stripe into units, reading every data unit that does
+ * not have skip[i] set. Units on failed disks are decoded from the rest of
+ * the stripe. Skipped units are only read if they are needed to decode
+ * another unit.
+ *
+ * Returns 0 on success and -1 if too many disks have failed.
+ */
+static int load_stripe(int stripe, char **units, int *present, const int *skip) {
+    int want[num_controllers];
+    for (int i = 0; i < num_controllers; i++) {
+        want[i] = i < num_disks && !skip[i];
+    }
+    read_units(stripe, want, units, present);
+    int missing = 0;
+    for (int i = 0; i < num_disks; i++) {
+        if (!skip[i] && !present[i]) {
+            missing = 1;
+        }
+    }
+    if (!missing) {
+        return 0;
+    }
+
+    // Degraded stripe: gather whatever else survives and decode
+    for (int i = 0; i < num_controllers; i++) {
+        want[i] = 1;
+    }
+    read_units(stripe, want, units, present);
+    if (decode_stripe(&code, units, present, block_size) == -1) {
+        fprintf(stderr, "Error: stripe %d has lost too many disks\n", stripe);
         return -1;
     }
     return 0;
 }
 
-/* Write a block of data to the block at block_num on the appropriate disk.
- * The block is stored at the memory pointed to by data.
- *
- * If parity_flag == 1, write to parity disk.
- * If parity_flag == 0, write to data disk.
+/* Reconstruct the unit of stripe held by the failed disk disk_num from the
+ * surviving disks into data. Only the units the code needs for the repair
+ * are read: the local group for LRC, or num_disks units otherwise.
  *
  * Returns 0 on success and -1 on failure.
  */
-int write_block_to_disk(int block_num, char *data, int parity_flag) {
-    if (data == NULL) {
-        fprintf(stderr, "Invalid data buffer\n");
+static int reconstruct_unit(int disk_num, int stripe, char *data) {
+    char *units[num_controllers];
+    int present[num_controllers];
+    int failed[num_controllers];
+    int needed[num_controllers];
+    if (get_stripe_buffers(units, present) == -1) {
         return -1;
     }
 
-    // Identify the stripe to read from
-    int disk_num;
-    if (parity_flag == 1) {
-        disk_num = num_disks;
+    // Another disk may fail while we read, in which case a new set of
+    // units is chosen; each retry has one more failed disk.
+    int status = -1;
+    for (int attempt = 0; attempt < num_controllers && status == -1; attempt++) {
+        for (int i = 0; i < num_controllers; i++) {
+            failed[i] = controllers[i].failed || i == disk_num;
+        }
+        if (repair_units(&code, disk_num, failed, needed) == -1) {
+            break;
+        }
+        __atomic_fetch_add(&repair_reads, read_units(stripe, needed, units, present), __ATOMIC_RELAXED);
+        int complete = 1;
+        for (int i = 0; i < num_controllers; i++) {
+            if (needed[i] && !present[i]) {
+                complete = 0;
+            }
+        }
+        if (!complete) {
+            continue;
+        }
+        status = repair_unit(&code, units, needed, disk_num, block_size);
+    }
+    if (status == 0) {
+        memcpy(data, units[disk_num], block_size);
     } else {
-        disk_num = block_num % num_disks;
+        fprintf(stderr, "Error: stripe %d has lost too many disks\n", stripe);
     }
+    put_stripe_buffers(units);
+    return status;
+}
 
-    disk_command_t cmd = CMD_WRITE;
+/* Rebuild the failed disk disk_num onto a fresh disk process, stripe by
+ * stripe, and report how many units were read per unit rebuilt. A cache
+ * tier mirror is copied from the other mirror instead.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int rebuild_disk(int disk_num) {
+    if (disk_num < 0 || disk_num >= num_channels) {
+        fprintf(stderr, "Invalid disk number\n");
+        return -1;
+    }
+    if (!controllers[disk_num].failed) {
+        fprintf(stderr, "Disk %d has not failed\n", disk_num);
+        return -1;
+    }
+    // The rebuilt blocks are written IPC_BATCH at a time
+    char *batch = malloc((size_t)IPC_BATCH * block_size);
+    if (batch == NULL) {
+        perror("malloc");
+        return -1;
+    }
 
-    // Each disk has a linear array of blocks, so the block number on an
-    // individual disk is the same as the stripe number
-    block_num = block_num / num_disks;
+    if (endpoints != NULL) {
+        // The replacement daemon is started by hand on the remote machine
+        if (restart_disk(disk_num) == -1) {
+            fprintf(stderr, "Disk %d is not back yet; restart its raid_disk and retry\n", disk_num);
+            free(batch);
+            return -1;
+        }
+    } else {
+        // Make sure the old process is gone before replacing it
+        if (controllers[disk_num].pid != -1) {
+            kill(controllers[disk_num].pid, SIGKILL);
+            if (waitpid(controllers[disk_num].pid, NULL, 0) == -1 && errno != ECHILD) {
+                perror("rebuild_disk: waitpid");
+            }
+        }
+        if (socket_dir == NULL) {
+            close(controllers[disk_num].to_disk[1]);
+            close(controllers[disk_num].from_disk[0]);
+        }
+        restore_disk_process(disk_num);
+    }
+
+    // The disk stays marked failed until the end so that no repair reads it
+    flight_record(FLIGHT_REBUILD_START, disk_num, -1, -1);
+    int mirror = disk_num >= num_controllers;
+    int other = mirror ? 2 * num_controllers + 1 - disk_num : -1;
+    int stripes = mirror ? tier_blocks : disk_size / block_size;
+    long long reads_before = repair_reads;
+    double start = monotonic_ms();
+    int status = 0;
+    int filled = 0;
+    for (int stripe = 0; stripe < stripes; stripe++) {
+        char *buf = batch + (size_t)filled * block_size;
+        int rebuilt;
+        if (mirror) {
+            rebuilt = !controllers[other].failed && read_block_from_disk(other, stripe, buf) == 0;
+            repair_reads += rebuilt;
+        } else {
+            rebuilt = reconstruct_unit(disk_num, stripe, buf) == 0;
+        }
+        filled += rebuilt;
+        if (rebuilt && (filled == IPC_BATCH || stripe == stripes - 1)) {
+            rebuilt = write_blocks_to_disk(disk_num, stripe - filled + 1, filled, batch) == 0;
+            filled = 0;
+        }
+        if (!rebuilt) {
+            fprintf(stderr, "Failed to rebuild stripe %d of disk %d\n", stripe, disk_num);
+            status = -1;
+            break;
+        }
+        metrics_rebuild(disk_num, stripe + 1, stripes);
+    }
+    double ms = monotonic_ms() - start;
+    free(batch);
+    metrics_rebuild(-1, 0, 0);
+    flight_record(FLIGHT_REBUILD_DONE, disk_num, -1, status);
+    if (status == -1) {
+        return -1;
+    }
 
-    // Write the command and the block number to the disk process
-    // Then read the block from the disk process
+    controllers[disk_num].failed = 0;
+    metrics_disk_failed(disk_num, 0);
+    long long reads = repair_reads - reads_before;
+    printf("Rebuilt disk %d: %d blocks in %.1f ms (%.1f MB/s), %lld blocks read, %.2f reads per block\n",
+           disk_num, stripes, ms, ms > 0 ? (double)stripes * block_size / ms / 1000.0 : 0.0,
+           reads, (double)reads / stripes);
+    return 0;
+}
 
-    // Write cmd to the disk process
-    if (write(controllers[disk_num].to_disk[1], &cmd, sizeof(cmd)) != sizeof(cmd)) {
-        fprintf(stderr, "write_block_to_disk: write cmd to disk failed\n");
+/* Write the blocks of stripe that are not NULL in blocks, which has one
+ * entry per data disk, and update the parity. When every data block is
+ * given this is a full-stripe write that reads nothing; otherwise the rest
+ * of the data in the stripe is read so that all of the parity units can be
+ * recomputed. Writes to failed disks are skipped; their contents are
+ * implied by the parity.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int write_stripe(int stripe, char **blocks) {
+    char *units[num_controllers];
+    int present[num_controllers];
+    int skip[num_controllers];
+    if (get_stripe_buffers(units, present) == -1) {
         return -1;
     }
+    for (int i = 0; i < num_controllers; i++) {
+        skip[i] = i < num_disks && blocks[i] != NULL;
+    }
 
-    // Write block_num to the disk process
-    if (write(controllers[disk_num].to_disk[1], &block_num, sizeof(block_num)) != sizeof(block_num)) {
-        fprintf(stderr, "write_block_to_disk: write block num to disk failed\n");
+    // Read data from the other disks to update parity
+    if (load_stripe(stripe, units, present, skip) == -1) {
+        put_stripe_buffers(units);
         return -1;
     }
-    
-    // Write block data to the disk process
-    if (write(controllers[disk_num].to_disk[1], data, block_size) != block_size) {
-        fprintf(stderr, "write_block_to_disk: write data to disk failed\n");
+    for (int i = 0; i < num_disks; i++) {
+        if (skip[i]) {
+            memcpy(units[i], blocks[i], block_size);
+        }
+    }
+    perf_sample_t sample;
+    perf_begin(&sample);
+    encode_stripe(&code, units, block_size);
+    perf_end(PERF_PARITY, &sample, num_disks * block_size);
+
+    // Write the block data and the updated parity data
+    int status = 0;
+    for (int i = 0; i < num_controllers; i++) {
+        if ((i < num_disks && !skip[i]) || controllers[i].failed) {
+            continue;
+        }
+        if (write_block_to_disk(i, stripe, units[i]) != 0) {
+            fprintf(stderr, "Failed to write block to disk %d\n", i);
+            mark_disk_failed(i);
+        }
+    }
+
+    // The write is lost only if the stripe can no longer be decoded
+    int failed = 0;
+    for (int i = 0; i < num_controllers; i++) {
+        failed += controllers[i].failed;
+    }
+    if (failed > num_parity) {
+        fprintf(stderr, "Failed to write block: too many failed disks\n");
+        status = -1;
+    }
+    put_stripe_buffers(units);
+    return status;
+}
+
+/* Write the memory pointed to by data to the block at block_num on the
+ * capacity disks, bypassing the cache tier.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int capacity_write(int block_num, char *data) {
+    char *blocks[num_disks];
+    for (int i = 0; i < num_disks; i++) {
+        blocks[i] = NULL;
+    }
+    blocks[block_num % num_disks] = data;
+    return write_stripe(block_num / num_disks, blocks);
+}
+
+/* Make one round of raw accesses to stripe on the first n data disks, for
+ * the performance model to time: if write is set their units are written
+ * from units without waiting for the disks, and otherwise all are read
+ * into units in parallel. Writing back the units of a read round leaves
+ * the parity of the stripe valid.
+ *
+ * Returns 0 on success and -1 on failure, such as when a disk has failed.
+ */
+int access_round(int stripe, int n, char **units, int write) {
+    for (int i = 0; i < n; i++) {
+        if (controllers[i].failed) {
+            return -1;
+        }
+    }
+    // The replies to the requests that were sent are collected even after a
+    // failure, so that the channels stay in step
+    int sent = 0, locked = 0, status = 0;
+    while (sent < n && status == 0) {
+        if (write) {
+            status = write_block_to_disk(sent, stripe, units[sent]);
+        } else {
+            pthread_mutex_lock(&controllers[sent].lock);
+            locked++;
+            status = send_read_request(sent, stripe);
+        }
+        sent += status == 0;
+    }
+    for (int i = 0; i < sent && !write; i++) {
+        if (receive_block(i, units[i]) == -1) {
+            mark_disk_failed(i);
+            status = -1;
+        }
+    }
+    for (int i = 0; i < locked; i++) {
+        pthread_mutex_unlock(&controllers[i].lock);
+    }
+    return status;
+}
+
+/* Read the block at block_num from the capacity disks into the memory
+ * pointed to by data, bypassing the cache tier. Blocks on failed disks are
+ * reconstructed from the rest of their stripe.
+ *
+ * Returns a pointer to the data buffer on success and NULL on failure.
+ */
+char *capacity_read(int block_num, char *data) {
+    int disk_num = block_num % num_disks;
+    int stripe = block_num / num_disks;
+
+    // Read block data from the correct disk
+    if (!controllers[disk_num].failed) {
+        if (read_block_from_disk(disk_num, stripe, data) == 0) {
+            return data;
+        }
+        mark_disk_failed(disk_num);
+    }
+    if (reconstruct_unit(disk_num, stripe, data) != 0) {
+        fprintf(stderr, "Failed to read block from disk\n");
+        return NULL;
+    }
+    return data;
+}
+
+/* Read slot of the cache tier into data from one of its two mirrors. The
+ * mirror is chosen by slot so that reads are spread over both.
+ *
+ * Returns 0 on success and -1 if neither mirror could be read.
+ */
+int read_tier_block(int slot, char *data) {
+    for (int n = 0; n < TIER_DISKS; n++) {
+        int disk_num = num_controllers + (slot + n) % TIER_DISKS;
+        if (controllers[disk_num].failed) {
+            continue;
+        }
+        if (read_block_from_disk(disk_num, slot, data) == 0) {
+            return 0;
+        }
+        mark_disk_failed(disk_num);
+    }
+    fprintf(stderr, "Error: both cache tier mirrors have failed\n");
+    return -1;
+}
+
+/* Write data to slot of the cache tier on both of its mirrors.
+ *
+ * Returns 0 on success and -1 if neither mirror could be written.
+ */
+int write_tier_block(int slot, char *data) {
+    int written = 0;
+    for (int disk_num = num_controllers; disk_num < num_controllers + TIER_DISKS; disk_num++) {
+        if (controllers[disk_num].failed) {
+            continue;
+        }
+        if (write_block_to_disk(disk_num, slot, data) == 0) {
+            written++;
+        } else {
+            mark_disk_failed(disk_num);
+        }
+    }
+    if (written == 0) {
+        fprintf(stderr, "Error: both cache tier mirrors have failed\n");
         return -1;
     }
     return 0;
@@ -271,7 +1388,10 @@ int write_block_to_disk(int block_num, char *data, int parity_flag) {
  * If block_num is invalid (outside the range 0 to disk_size/block_size)
  * then return -1.
  *
- * Returns 0 on success and the disk number we tried to read from on failure.
+ * With a cache tier the write is absorbed by the tier and reaches the
+ * capacity disks later, when its stripe is destaged.
+ *
+ * Returns 0 on success and -1 on failure.
  */
 int write_block(int block_num, char *data) {
     if (data == NULL) {
@@ -285,68 +1405,24 @@ int write_block(int block_num, char *data) {
         return -1;
     }
 
-    // Identify the disk_num and stripe to write to
-    int disk_num = block_num % num_disks;
-    int stripe = block_num / num_disks;
-
-    // Check if we are writing to the parity disk
-    int parity_flag = 0;
-    if (disk_num == num_disks) {
-        parity_flag = 1;
+    double start = monotonic_ms();
+    perf_sample_t sample;
+    perf_begin(&sample);
+    heat_touch(block_num);
+    int status;
+    if (tier_enabled()) {
+        status = tier_write(block_num, data);
+    } else {
+        status = capacity_write(block_num, data);
     }
-
-    // Write block data to the correct disk
-    if (write_block_to_disk(block_num, data, parity_flag) != 0) {
-        fprintf(stderr, "Failed to write block to disk\n");
-        return -1;
+    if (status == 0) {
+        replicate_write(block_num, data);
     }
-
-    // Update parity disk if necessary
-    if (parity_flag == 0) {
-        char *parity_data = calloc(1, block_size);
-        // sanity check
-        if (parity_data == NULL) {
-            perror("calloc");
-            return -1;
-        }
-
-        // Read data from the disk to update parity
-        for (int i = 0; i < num_disks; i++) {
-            if (i != disk_num) {
-                char *temp_data = malloc(block_size);
-                // sanity check
-                if (temp_data == NULL) {
-                    perror("malloc");
-                    free(parity_data);
-                    return -1;
-                }
-                if (read_block_from_disk(i, temp_data, 0) != 0) {
-                    fprintf(stderr, "Failed to read block from disk\n");
-                    free(temp_data);
-                    free(parity_data);
-                    return -1;
-                }
-                for (int j = 0; j < block_size; j++) {
-                    parity_data[j] ^= temp_data[j];
-                }
-                free(temp_data);
-            }
-        }
-        
-        // Update the parity data with new block
-        for (int i = 0; i < block_size; i++) {
-            parity_data[i] ^= data[i];
-        }
-
-        // Write updated parity data to the parity disk
-        if (write_block_to_disk(stripe, parity_data, 1) != 0) {
-            fprintf(stderr, "Failed to write updated parity block\n");
-            free(parity_data);
-            return -1;
-        }
-        free(parity_data);
-    }
-    return 0;
+    perf_end(PERF_WRITE_BLOCK, &sample, block_size);
+    double ms = monotonic_ms() - start;
+    metrics_request(1, block_size, ms, status != 0);
+    flight_record(status == 0 ? FLIGHT_WRITE : FLIGHT_WRITE_FAILED, -1, block_num, (int)(ms * 1000));
+    return status;
 }
 
 /* Read the block at block_num from the RAID system into
@@ -354,6 +1430,9 @@ int write_block(int block_num, char *data) {
  * If block_num is invalid (outside the range 0 to disk_size/block_size)
  * then return NULL.
  *
+ * Blocks held by the cache tier are read from it; the others come from the
+ * capacity disks.
+ *
  * Returns a pointer to the data buffer on success and NULL on failure.
  */
 char *read_block(int block_num, char *data) {
@@ -368,45 +1447,275 @@ char *read_block(int block_num, char *data) {
         return NULL;
     }
 
-    // Read block data from the correct disk
-    if (read_block_from_disk(block_num, data, 0) != 0) {
-        fprintf(stderr, "Failed to read block from disk\n");
-        return NULL;
+    double start = monotonic_ms();
+    perf_sample_t sample;
+    perf_begin(&sample);
+    heat_touch(block_num);
+    char *result;
+    if (tier_enabled()) {
+        result = tier_read(block_num, data);
+    } else {
+        result = capacity_read(block_num, data);
     }
-    return data;
+    perf_end(PERF_READ_BLOCK, &sample, block_size);
+    double ms = monotonic_ms() - start;
+    metrics_request(0, block_size, ms, result == NULL);
+    flight_record(result != NULL ? FLIGHT_READ : FLIGHT_READ_FAILED, -1, block_num, (int)(ms * 1000));
+    return result;
 }
 
 /* Send exit command to all disk processes.
  *
- * Returns when all disk processes have terminated.
+ * The disks checkpoint in parallel, all with a new epoch, and report their
+ * own throughput. This returns when all disk processes have terminated, or
+ * once shutdown_timeout seconds have passed, in which case the remaining
+ * disks that are children of this controller are killed. Their previous
+ * checkpoint files are left intact.
  */
 void checkpoint_and_wait() {
-    for (int i = 0; i < num_disks + 1; i++) {
+    double start = monotonic_ms();
+    struct pollfd fds[num_channels];
+
+    epoch++;
+    for (int i = 0; i < num_channels; i++) {
         disk_command_t cmd = CMD_EXIT;
-        size_t bytes_written = write(controllers[i].to_disk[1], &cmd, sizeof(cmd));
-        if (bytes_written != sizeof(cmd)) {
+        if (write_full(controllers[i].to_disk[1], &cmd, sizeof(cmd)) != sizeof(cmd)
+                || write_full(controllers[i].to_disk[1], &epoch, sizeof(epoch)) != sizeof(epoch)) {
             fprintf(stderr, "Warning: Failed to send exit command to disk %d\n", i);
         }
+        // A disk closes its end of the channel when it exits. Reattached
+        // disks are not our children, so this is the only way to wait for them.
+        fds[i].fd = controllers[i].from_disk[0];
+        fds[i].events = POLLIN;
     }
+
     // wait for all disks to exit
     // we aren't going to do anything with the exit value
-    for (int i = 0; i < num_disks + 1; i++) {
-        wait(NULL);
+    int remaining = 0;
+    for (int i = 0; i < num_channels; i++) {
+        remaining += fds[i].fd != -1;
+    }
+    while (remaining > 0) {
+        int timeout = -1;
+        if (shutdown_timeout > 0) {
+            timeout = (int)(shutdown_timeout * 1000 - (monotonic_ms() - start));
+            if (timeout <= 0) {
+                break;
+            }
+        }
+        if (poll(fds, num_channels, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("checkpoint_and_wait: poll");
+            break;
+        }
+        for (int i = 0; i < num_channels; i++) {
+            char buf[64];
+            if (fds[i].fd == -1 || fds[i].revents == 0 || read(fds[i].fd, buf, sizeof(buf)) > 0) {
+                continue;
+            }
+            fds[i].fd = -1;
+            remaining--;
+            if (controllers[i].child && waitpid(controllers[i].pid, NULL, 0) == -1 && errno != ECHILD) {
+                perror("checkpoint_and_wait: waitpid");
+            }
+            if (debug) {
+                printf("Disk %d shut down after %.1f ms\n", i, monotonic_ms() - start);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_channels; i++) {
+        if (fds[i].fd == -1) {
+            continue;
+        }
+        // Only our own children are killed; a reattached or remote disk
+        // may still be finishing its checkpoint, so it is just left behind
+        if (!controllers[i].child) {
+            fprintf(stderr, "Warning: Disk %d did not shut down within %d seconds, leaving it\n",
+                    i, shutdown_timeout);
+            close(controllers[i].to_disk[1]);
+            close(controllers[i].from_disk[0]);
+            controllers[i].to_disk[1] = controllers[i].from_disk[0] = -1;
+            continue;
+        }
+        fprintf(stderr, "Warning: Disk %d did not shut down within %d seconds, killing it\n",
+                i, shutdown_timeout);
+        kill(controllers[i].pid, SIGKILL);
+        if (waitpid(controllers[i].pid, NULL, 0) == -1 && errno != ECHILD) {
+            perror("checkpoint_and_wait: waitpid");
+        }
+    }
+    if (debug) {
+        printf("Shutdown of %d disks took %.1f ms\n", num_channels, monotonic_ms() - start);
+    }
+}
+
+/* Take a consistent checkpoint of the whole array without stopping it.
+ *
+ * Every disk is asked to snapshot its data for the next epoch. Since the
+ * controller issues no other requests until every disk has acknowledged the
+ * epoch, all snapshots reflect the same point in the request stream. The
+ * disks write their snapshots in the background and keep serving requests.
+ *
+ * The map of the cache tier lives only in the controller, so the tier is
+ * flushed first; otherwise writes it still holds would be missing from the
+ * capacity disks' snapshots.
+ *
+ * Returns 0 on success and -1 if any disk failed to take its snapshot.
+ */
+int checkpoint_all() {
+    int status = 0;
+    int sent[num_channels];
+
+    if (tier_flush() == -1) {
+        fprintf(stderr, "Warning: Cannot checkpoint while the cache tier holds writes\n");
+        return -1;
+    }
+
+    epoch++;
+    flight_record(FLIGHT_CHECKPOINT, -1, -1, epoch);
+    for (int i = 0; i < num_channels; i++) {
+        disk_command_t cmd = CMD_CHECKPOINT;
+        sent[i] = write_full(controllers[i].to_disk[1], &cmd, sizeof(cmd)) == sizeof(cmd)
+                && write_full(controllers[i].to_disk[1], &epoch, sizeof(epoch)) == sizeof(epoch);
+        if (!sent[i]) {
+            fprintf(stderr, "Warning: Failed to send checkpoint command to disk %d\n", i);
+            status = -1;
+        }
+    }
+
+    // Barrier: collect every acknowledgement before any further I/O
+    for (int i = 0; i < num_channels; i++) {
+        int ack;
+        if (!sent[i]) {
+            continue;
+        }
+        if (read_full(controllers[i].from_disk[0], &ack, sizeof(ack)) != sizeof(ack) || ack != epoch) {
+            fprintf(stderr, "Warning: Disk %d did not checkpoint epoch %d\n", i, epoch);
+            status = -1;
+        }
+    }
+    if (debug) {
+        printf("Checkpoint epoch %d started\n", epoch);
+    }
+    return status;
+}
+
+/* Close the channels to all disk processes without asking them to exit.
+ * Disks listening on named sockets keep their data and wait for a new
+ * controller to reattach; disks connected by pipes checkpoint and exit.
+ */
+void detach_all_controllers() {
+    for (int i = 0; i < num_channels; i++) {
+        close(controllers[i].to_disk[1]);
+        close(controllers[i].from_disk[0]);
     }
+    free(controllers);
+    controllers = NULL;
+    free_region(buffer_pool, (size_t)pool_size * block_size, huge_pages);
+    free(free_buffers);
 }
 
 
 /* Simulate the failure of a disk by sending the SIGINT signal to the
- * process with id disk_num.
+ * process with id disk_num. A remote disk cannot be signalled, so it is
+ * told to exit and its connection is closed instead. It exits with epoch -1,
+ * so that its last checkpoint is never resumed along with the others.
  */
 void simulate_disk_failure(int disk_num) {
     if(debug) {
         printf("Simulate: killing disk %d\n", disk_num);
     }
-    kill(controllers[disk_num].pid, SIGINT);
-    if (waitpid(controllers[disk_num].pid, NULL, 0) == -1) {
+    if (endpoints != NULL) {
+        disk_command_t cmd = CMD_EXIT;
+        int no_epoch = -1;
+        if (controllers[disk_num].to_disk[1] != -1) {
+            write_full(controllers[disk_num].to_disk[1], &cmd, sizeof(cmd));
+            write_full(controllers[disk_num].to_disk[1], &no_epoch, sizeof(no_epoch));
+            detach_socket(disk_num);
+        }
+    } else if (controllers[disk_num].pid != -1) {
+        kill(controllers[disk_num].pid, SIGINT);
+    }
+    controllers[disk_num].failed = 1;
+    metrics_disk_failed(disk_num, 1);
+    flight_record(FLIGHT_DISK_FAILED, disk_num, -1, SIGINT);
+    if (controllers[disk_num].child && waitpid(controllers[disk_num].pid, NULL, 0) == -1 && errno != ECHILD) {
         perror("simulate_disk_failure: waitpid");
     }
+    // The process is gone, so its pid may already belong to another one
+    controllers[disk_num].pid = -1;
+    controllers[disk_num].child = 0;
+}
+
+/* Pin the process pid to the single CPU at position index (modulo the
+ * number of CPUs) in the set the controller was started with. If index is
+ * -1 the process is allowed to run on that whole set again.
+ */
+static void pin_process(pid_t pid, int index) {
+    static cpu_set_t allowed;
+    static int num_allowed = 0;
+    if (num_allowed == 0) {
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+            perror("sched_getaffinity");
+            return;
+        }
+        num_allowed = CPU_COUNT(&allowed);
+    }
+
+    cpu_set_t set = allowed;
+    if (index >= 0) {
+        // Find the (index % num_allowed)-th CPU in the allowed set
+        int want = index % num_allowed;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && want-- == 0) {
+                CPU_SET(cpu, &set);
+                break;
+            }
+        }
+    }
+    if (sched_setaffinity(pid, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+    }
+}
+
+/* Pin the num-th disk process according to affinity. With AFFINITY_SPREAD
+ * each disk gets a core of its own next to the controller's; with
+ * AFFINITY_COLOCATE the disk shares the controller's core, since the
+ * controller is the one that handles every reply from the disk.
+ */
+static void pin_disk(int num) {
+    // A remote disk runs on another machine
+    if (controllers[num].pid == -1) {
+        return;
+    }
+    switch (affinity) {
+        case AFFINITY_SPREAD:
+            pin_process(controllers[num].pid, num + 1);
+            break;
+        case AFFINITY_COLOCATE:
+            pin_process(controllers[num].pid, 0);
+            break;
+        default:
+            pin_process(controllers[num].pid, -1);
+            break;
+    }
+}
+
+/* Change the CPU affinity of the controller and every disk process to mode.
+ * The controller runs on the first allowed CPU unless mode is AFFINITY_NONE.
+ */
+void set_affinity(affinity_t mode) {
+    affinity = mode;
+    pin_process(0, mode == AFFINITY_NONE ? -1 : 0);
+    for (int i = 0; i < num_channels; i++) {
+        if (controllers[i].pid > 0) {
+            pin_disk(i);
+        }
+    }
 }
 
 /* Restore the disk process after it has been killed.
@@ -419,4 +1728,8 @@ void restore_disk_process(int disk_num) {
         fprintf(stderr, "Failed to restore disk process for disk num: %d\n", disk_num);
         exit(1);
     }
+    if (affinity != AFFINITY_NONE) {
+        pin_disk(disk_num);
+    }
+    perf_attach_disk(disk_num, controllers[disk_num].pid);
 }
@@ -0,0 +1,744 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raid.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/*
+ * This file implements the erasure codes that protect a stripe. A stripe is
+ * made of k data units followed by m parity units, one unit per disk:
+ *
+ * - LAYOUT_RAID4 has a single parity unit that is the XOR of the data units.
+ * - LAYOUT_RS is a Reed-Solomon code over GF(2^8) whose m parity units are
+ *   computed with a Cauchy matrix, so that any k of the k + m units are
+ *   enough to recover the rest.
+ * - LAYOUT_LRC is a locally repairable code. The data units are split into
+ *   groups of code->group units, each protected by a local XOR parity, and
+ *   the remaining parity units are global Cauchy parities over all the data.
+ *   A single lost unit is repaired from its group alone.
+ * - LAYOUT_RDP is row-diagonal parity, which survives any two failures
+ *   with XOR alone. Each unit is split into p - 1 rows for a prime p > k;
+ *   the first parity unit is the XOR of each row and the second the XOR of
+ *   each diagonal across the data and the row parity.
+ *
+ * For the other layouts every unit is a linear combination of the data
+ * units, given by a row of the (k + m) x k generator matrix, so one decoder
+ * serves all of them.
+ *
+ * The inner loops are SIMD kernels when the CPU supports them, with scalar
+ * fallbacks for other machines.
+ */
+
+// The field is GF(2^8) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1
+#define GF_POLY 0x11d
+
+static unsigned char gf_exp[512];
+static unsigned char gf_log[256];
+
+/* Fill the exponent and logarithm tables of the field, once.
+ */
+static void gf_init() {
+    static int done = 0;
+    if (done) {
+        return;
+    }
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLY;
+        }
+    }
+    // Doubling the table lets gf_mul skip the modulo
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    done = 1;
+}
+
+/* Return a * b in GF(2^8).
+ */
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+    if (a == 0 || b == 0) {
+        return 0;
+    }
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+/* Return the multiplicative inverse of a, which must not be 0.
+ */
+static unsigned char gf_inv(unsigned char a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+#ifdef HAVE_X86_SIMD
+/* XOR 16 bytes at a time with SSE2. Returns the number of bytes done.
+ */
+__attribute__((target("sse2")))
+static int xor_sse2(unsigned char *dst, const unsigned char *src, int len) {
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, s));
+    }
+    return i;
+}
+
+/* Multiply 16 bytes at a time by a constant with SSSE3 byte shuffles, using
+ * the products of the constant with every low nibble (lo) and high nibble
+ * (hi), and XOR the result into dst. Returns the number of bytes done.
+ */
+__attribute__((target("ssse3")))
+static int gf_mul_xor_ssse3(unsigned char *dst, const unsigned char *src,
+                            const unsigned char *lo, const unsigned char *hi, int len) {
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i l = _mm_and_si128(x, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(x, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, l), _mm_shuffle_epi8(thi, h));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+    }
+    return i;
+}
+#endif
+
+/* XOR len bytes of src into dst.
+ */
+void xor_region(char *dst, const char *src, int len) {
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+    int i = 0;
+#ifdef HAVE_X86_SIMD
+    i = xor_sse2(d, s, len);
+#endif
+    for (; i < len; i++) {
+        d[i] ^= s[i];
+    }
+}
+
+/* Multiply len bytes of src by the constant c and XOR the products into dst.
+ */
+void gf_mul_region(char *dst, const char *src, unsigned char c, int len) {
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+    if (c == 0) {
+        return;
+    }
+    if (c == 1) {
+        xor_region(dst, src, len);
+        return;
+    }
+
+    // c * x = c * (x & 0x0f) ^ c * (x & 0xf0), so two 16 entry tables suffice
+    unsigned char lo[16], hi[16];
+    for (int n = 0; n < 16; n++) {
+        lo[n] = gf_mul(c, n);
+        hi[n] = gf_mul(c, n << 4);
+    }
+
+    int i = 0;
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("ssse3")) {
+        i = gf_mul_xor_ssse3(d, s, lo, hi, len);
+    }
+#endif
+    for (; i < len; i++) {
+        d[i] ^= lo[s[i] & 0x0f] ^ hi[s[i] >> 4];
+    }
+}
+
+/* Set up code as the layout erasure code with k data and m parity units.
+ * For LAYOUT_LRC, group is the number of data units per local group and m
+ * counts both the local and the global parity units.
+ *
+ * Returns 0 on success and -1 if the code cannot be built.
+ */
+int init_code(code_t *code, layout_t layout, int k, int m, int group) {
+    gf_init();
+    code->layout = layout;
+    code->k = k;
+    code->m = m;
+    code->group = k;
+    code->local = 0;
+    code->matrix = NULL;
+
+    int rows = m;
+    if (layout == LAYOUT_LRC) {
+        code->group = group;
+        code->local = (k + group - 1) / group;
+        rows = m - code->local;
+        if (rows < 1) {
+            fprintf(stderr, "Error: LRC needs at least one global parity disk\n");
+            return -1;
+        }
+    }
+
+    if (layout == LAYOUT_RAID4) {
+        if (m != 1) {
+            fprintf(stderr, "Error: RAID 4 has exactly one parity disk\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (layout == LAYOUT_RDP) {
+        if (m != 2) {
+            fprintf(stderr, "Error: RDP has exactly two parity disks\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (k + m > 256) {
+        fprintf(stderr, "Error: Reed-Solomon supports at most 256 disks\n");
+        return -1;
+    }
+    code->matrix = malloc(rows * k);
+    if (code->matrix == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    // Cauchy matrix 1 / (x_i + y_j) with x_i = k + i and y_j = j. Every
+    // square submatrix of a Cauchy matrix is invertible, which is what makes
+    // any k surviving units enough to decode.
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < k; j++) {
+            code->matrix[i * k + j] = gf_inv((k + i) ^ j);
+        }
+    }
+    return 0;
+}
+
+/* Release the memory held by code.
+ */
+void free_code(code_t *code) {
+    free(code->matrix);
+    code->matrix = NULL;
+}
+
+/* Return the coefficient that unit row contributes for data unit col, in
+ * the (k + m) x k generator matrix whose top k rows are the identity.
+ */
+static unsigned char generator(code_t *code, int row, int col) {
+    if (row < code->k) {
+        return row == col;
+    }
+    int p = row - code->k;
+    switch (code->layout) {
+        case LAYOUT_RAID4:
+            return 1;
+        case LAYOUT_LRC:
+            if (p < code->local) {
+                return col / code->group == p;
+            }
+            p -= code->local;
+            break;
+        default:
+            break;
+    }
+    return code->matrix[p * code->k + col];
+}
+
+/* Return non-zero if unit i belongs to local group g of an LRC, which is
+ * made of the group's data units and its local parity unit.
+ */
+static int in_group(code_t *code, int i, int g) {
+    return (i < code->k && i / code->group == g) || i == code->k + g;
+}
+
+/* Return the prime p that row-diagonal parity uses for k data units of len
+ * bytes: the smallest prime above k for which the units split evenly into
+ * p - 1 rows.
+ *
+ * Returns p on success and -1 if there is no such prime.
+ */
+int rdp_prime(int k, int len) {
+    for (int p = k + 1; p <= len + 1; p++) {
+        if (len % (p - 1) != 0) {
+            continue;
+        }
+        int prime = p >= 2;
+        for (int d = 2; d * d <= p && prime; d++) {
+            prime = p % d != 0;
+        }
+        if (prime) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+/* In row-diagonal parity the data units are columns 0 to k - 1 and the row
+ * parity is column p - 1. Columns k to p - 2 are imaginary and all zero.
+ * Return the unit that holds column col, or -1 for an imaginary column.
+ */
+static int rdp_unit(int k, int p, int col) {
+    if (col < k) {
+        return col;
+    }
+    return col == p - 1 ? k : -1;
+}
+
+/* Set cell (row, col) to the XOR of the other cells of its row, each of
+ * size bytes.
+ */
+static void rdp_row_cell(char **units, int k, int p, int row, int col, int size) {
+    char *dst = units[rdp_unit(k, p, col)] + (size_t)row * size;
+    memset(dst, 0, size);
+    for (int c = 0; c < p; c++) {
+        int u = rdp_unit(k, p, c);
+        if (c != col && u != -1) {
+            xor_region(dst, units[u] + (size_t)row * size, size);
+        }
+    }
+}
+
+/* Set cell (row, col) from the diagonal parity of its diagonal and the
+ * other cells on that diagonal. A diagonal d holds the cells (r, c) with
+ * (r + c) mod p == d; row p - 1 is imaginary.
+ */
+static void rdp_diag_cell(char **units, int k, int p, int row, int col, int size) {
+    int d = (row + col) % p;
+    char *dst = units[rdp_unit(k, p, col)] + (size_t)row * size;
+    memcpy(dst, units[k + 1] + (size_t)d * size, size);
+    for (int c = 0; c < p; c++) {
+        int u = rdp_unit(k, p, c);
+        int r = (d - c + p) % p;
+        if (c != col && u != -1 && r != p - 1) {
+            xor_region(dst, units[u] + (size_t)r * size, size);
+        }
+    }
+}
+
+/* Compute the row and diagonal parity units of a stripe. Diagonal p - 1
+ * is not stored.
+ */
+static void rdp_encode(code_t *code, char **units, int len) {
+    int k = code->k;
+    int p = rdp_prime(k, len);
+    int size = len / (p - 1);
+
+    memset(units[k], 0, len);
+    for (int j = 0; j < k; j++) {
+        xor_region(units[k], units[j], len);
+    }
+    memset(units[k + 1], 0, len);
+    for (int c = 0; c < p; c++) {
+        int u = rdp_unit(k, p, c);
+        if (u == -1) {
+            continue;
+        }
+        for (int r = 0; r < p - 1; r++) {
+            int d = (r + c) % p;
+            if (d != p - 1) {
+                xor_region(units[k + 1] + (size_t)d * size, units[u] + (size_t)r * size, size);
+            }
+        }
+    }
+}
+
+/* Rebuild up to two lost units of a row-diagonal parity stripe. Lost
+ * columns are recovered cell by cell, alternating between rows and
+ * diagonals that are missing a single cell, until every cell is known.
+ *
+ * Returns 0 on success and -1 if more than two units are lost.
+ */
+static int rdp_decode(code_t *code, char **units, int *present, int len) {
+    int k = code->k;
+    int p = rdp_prime(k, len);
+    int size = len / (p - 1);
+    int lost[2];
+    int num_lost = 0;
+
+    for (int c = 0; c < p; c++) {
+        int u = rdp_unit(k, p, c);
+        if (u != -1 && !present[u]) {
+            if (num_lost == 2) {
+                return -1;
+            }
+            lost[num_lost++] = c;
+        }
+    }
+    if (num_lost == 2 && !present[k + 1]) {
+        return -1;
+    }
+
+    // known[i][r] is set once row r of column lost[i] is recovered
+    char known[2][p - 1];
+    memset(known, 0, sizeof(known));
+    int remaining = num_lost * (p - 1);
+    while (remaining > 0) {
+        int progress = 0;
+        for (int r = 0; r < p - 1; r++) {
+            int missing = 0, which = 0;
+            for (int i = 0; i < num_lost; i++) {
+                if (!known[i][r]) {
+                    missing++;
+                    which = i;
+                }
+            }
+            if (missing == 1) {
+                rdp_row_cell(units, k, p, r, lost[which], size);
+                known[which][r] = 1;
+                remaining--;
+                progress = 1;
+            }
+        }
+        for (int d = 0; d < p - 1 && num_lost == 2; d++) {
+            int missing = 0, which = 0;
+            for (int i = 0; i < 2; i++) {
+                int r = (d - lost[i] + p) % p;
+                if (r != p - 1 && !known[i][r]) {
+                    missing++;
+                    which = i;
+                }
+            }
+            if (missing == 1) {
+                int r = (d - lost[which] + p) % p;
+                rdp_diag_cell(units, k, p, r, lost[which], size);
+                known[which][r] = 1;
+                remaining--;
+                progress = 1;
+            }
+        }
+        if (!progress) {
+            return -1;
+        }
+    }
+
+    if (!present[k + 1]) {
+        rdp_encode(code, units, len);
+    }
+    for (int i = 0; i < k + 2; i++) {
+        present[i] = 1;
+    }
+    return 0;
+}
+
+/* Compute the parity units of a stripe. units[0] to units[k - 1] hold the
+ * data and units[k] to units[k + m - 1] receive the parity, each len bytes.
+ */
+void encode_stripe(code_t *code, char **units, int len) {
+    int k = code->k;
+    if (code->layout == LAYOUT_RDP) {
+        rdp_encode(code, units, len);
+        return;
+    }
+    for (int i = k; i < k + code->m; i++) {
+        memset(units[i], 0, len);
+        for (int j = 0; j < k; j++) {
+            gf_mul_region(units[i], units[j], generator(code, i, j), len);
+        }
+    }
+}
+
+/* Choose up to k units among those with usable[i] set whose generator rows
+ * are linearly independent, storing their numbers in rows. Units are taken
+ * in order, so for an MDS code this is simply the first k usable units.
+ *
+ * Returns the number of units chosen; k if they determine all the data.
+ */
+static int select_rows(code_t *code, const int *usable, int *rows) {
+    int k = code->k;
+    unsigned char basis[k][k];
+    int pivot[k];
+    int count = 0;
+
+    for (int i = 0; i < k + code->m && count < k; i++) {
+        if (!usable[i]) {
+            continue;
+        }
+        // Reduce the row against the basis; it is independent if anything
+        // is left over
+        unsigned char v[k];
+        for (int j = 0; j < k; j++) {
+            v[j] = generator(code, i, j);
+        }
+        for (int b = 0; b < count; b++) {
+            unsigned char f = v[pivot[b]];
+            if (f != 0) {
+                for (int j = 0; j < k; j++) {
+                    v[j] ^= gf_mul(f, basis[b][j]);
+                }
+            }
+        }
+        int p = 0;
+        while (p < k && v[p] == 0) {
+            p++;
+        }
+        if (p == k) {
+            continue;
+        }
+        unsigned char scale = gf_inv(v[p]);
+        for (int j = 0; j < k; j++) {
+            basis[count][j] = gf_mul(v[j], scale);
+        }
+        pivot[count] = p;
+        rows[count++] = i;
+    }
+    return count;
+}
+
+/* Find the units that must be read to rebuild unit target when the units
+ * with failed[i] set are lost. needed[i] is set for each of them.
+ *
+ * With LRC, a unit whose local group has no other failure is repaired
+ * from the rest of its group. Otherwise enough surviving units are chosen
+ * to determine all of the data.
+ *
+ * Returns the number of units needed and -1 if target cannot be rebuilt.
+ */
+int repair_units(code_t *code, int target, const int *failed, int *needed) {
+    int k = code->k;
+    int n = k + code->m;
+    for (int i = 0; i < n; i++) {
+        needed[i] = 0;
+    }
+
+    if (code->layout == LAYOUT_RDP) {
+        // A single lost unit needs the data, plus the row parity unless the
+        // diagonal parity is the one lost; a second failure needs the rest
+        int others = 0;
+        for (int i = 0; i < n; i++) {
+            others += failed[i] && i != target;
+        }
+        if (others > 1) {
+            return -1;
+        }
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            if (failed[i] || i == target) {
+                continue;
+            }
+            if (others == 0 && i == (target == k + 1 ? k : k + 1)) {
+                continue;
+            }
+            needed[i] = 1;
+            count++;
+        }
+        return count;
+    }
+
+    if (code->layout == LAYOUT_LRC && target < k + code->local) {
+        int g = target < k ? target / code->group : target - k;
+        int count = 0;
+        int intact = 1;
+        for (int i = 0; i < n; i++) {
+            if (in_group(code, i, g) && i != target) {
+                intact = intact && !failed[i];
+                needed[i] = 1;
+                count++;
+            }
+        }
+        if (intact) {
+            return count;
+        }
+        for (int i = 0; i < n; i++) {
+            needed[i] = 0;
+        }
+    }
+
+    int usable[n];
+    int rows[k];
+    for (int i = 0; i < n; i++) {
+        usable[i] = !failed[i] && i != target;
+    }
+    if (select_rows(code, usable, rows) < k) {
+        return -1;
+    }
+    for (int i = 0; i < k; i++) {
+        needed[rows[i]] = 1;
+    }
+    return k;
+}
+
+/* Invert the n x n matrix a over GF(2^8) into inv. a is destroyed.
+ *
+ * Returns 0 on success and -1 if a is singular.
+ */
+static int gf_invert(unsigned char *a, unsigned char *inv, int n) {
+    memset(inv, 0, n * n);
+    for (int i = 0; i < n; i++) {
+        inv[i * n + i] = 1;
+    }
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && a[pivot * n + col] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return -1;
+        }
+        if (pivot != col) {
+            for (int j = 0; j < n; j++) {
+                unsigned char t = a[col * n + j];
+                a[col * n + j] = a[pivot * n + j];
+                a[pivot * n + j] = t;
+                t = inv[col * n + j];
+                inv[col * n + j] = inv[pivot * n + j];
+                inv[pivot * n + j] = t;
+            }
+        }
+        unsigned char scale = gf_inv(a[col * n + col]);
+        for (int j = 0; j < n; j++) {
+            a[col * n + j] = gf_mul(a[col * n + j], scale);
+            inv[col * n + j] = gf_mul(inv[col * n + j], scale);
+        }
+        for (int row = 0; row < n; row++) {
+            unsigned char f = a[row * n + col];
+            if (row == col || f == 0) {
+                continue;
+            }
+            for (int j = 0; j < n; j++) {
+                a[row * n + j] ^= gf_mul(f, a[col * n + j]);
+                inv[row * n + j] ^= gf_mul(f, inv[col * n + j]);
+            }
+        }
+    }
+    return 0;
+}
+
+/* Rebuild the units of a stripe that are not present. units holds k + m
+ * buffers of len bytes, and present[i] is non-zero if units[i] holds valid
+ * data. On success every unit is valid and present is set for all of them.
+ *
+ * Returns 0 on success and -1 if the present units do not determine the
+ * data.
+ */
+int decode_stripe(code_t *code, char **units, int *present, int len) {
+    int k = code->k;
+    int n = k + code->m;
+    int rows[k];
+    int data_missing = 0;
+
+    if (code->layout == LAYOUT_RDP) {
+        return rdp_decode(code, units, present, len);
+    }
+
+    // A local group missing a single unit is repaired with XOR alone
+    for (int g = 0; g < code->local; g++) {
+        int lost = -1;
+        int count = 0;
+        for (int i = 0; i < n; i++) {
+            if (in_group(code, i, g) && !present[i]) {
+                lost = i;
+                count++;
+            }
+        }
+        if (count != 1) {
+            continue;
+        }
+        memset(units[lost], 0, len);
+        for (int i = 0; i < n; i++) {
+            if (in_group(code, i, g) && i != lost) {
+                xor_region(units[lost], units[i], len);
+            }
+        }
+        present[lost] = 1;
+    }
+
+    for (int i = 0; i < k; i++) {
+        if (!present[i]) {
+            data_missing = 1;
+        }
+    }
+
+    if (data_missing) {
+        if (select_rows(code, present, rows) < k) {
+            return -1;
+        }
+        // The chosen rows of the generator map the data onto the units we
+        // have, so its inverse maps the units we have back onto the data.
+        unsigned char a[k * k], inv[k * k];
+        for (int i = 0; i < k; i++) {
+            for (int j = 0; j < k; j++) {
+                a[i * k + j] = generator(code, rows[i], j);
+            }
+        }
+        if (gf_invert(a, inv, k) == -1) {
+            return -1;
+        }
+        for (int j = 0; j < k; j++) {
+            if (present[j]) {
+                continue;
+            }
+            memset(units[j], 0, len);
+            for (int i = 0; i < k; i++) {
+                gf_mul_region(units[j], units[rows[i]], inv[j * k + i], len);
+            }
+        }
+    }
+
+    // With all the data known, missing parity is simply recomputed
+    for (int i = k; i < n; i++) {
+        if (present[i]) {
+            continue;
+        }
+        memset(units[i], 0, len);
+        for (int j = 0; j < k; j++) {
+            gf_mul_region(units[i], units[j], generator(code, i, j), len);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        present[i] = 1;
+    }
+    return 0;
+}
+
+/* Rebuild unit target of a stripe from the units with needed[i] set, as
+ * chosen by repair_units. A local group repair is a plain XOR of the group;
+ * anything else decodes the whole stripe, overwriting the units that were
+ * not needed.
+ *
+ * Returns 0 on success and -1 if the needed units do not determine target.
+ */
+int repair_unit(code_t *code, char **units, const int *needed, int target, int len) {
+    int n = code->k + code->m;
+    if (code->layout == LAYOUT_LRC && target < code->k + code->local) {
+        int g = target < code->k ? target / code->group : target - code->k;
+        int local = 1;
+        for (int i = 0; i < n && local; i++) {
+            if (in_group(code, i, g) && i != target && !needed[i]) {
+                local = 0;
+            }
+        }
+        if (local) {
+            memset(units[target], 0, len);
+            for (int i = 0; i < n; i++) {
+                if (in_group(code, i, g) && i != target) {
+                    xor_region(units[target], units[i], len);
+                }
+            }
+            return 0;
+        }
+    }
+
+    int present[n];
+    for (int i = 0; i < n; i++) {
+        present[i] = needed[i];
+    }
+    return decode_stripe(code, units, present, len);
+}
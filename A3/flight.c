@@ -0,0 +1,241 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include "raid.h"
+
+/*
+ * This file is a flight recorder: every process keeps its last FLIGHT_EVENTS
+ * request events in a fixed ring, so that a collapse in performance or a
+ * hang can be diagnosed after the fact from what each process was doing.
+ *
+ * Recording an event claims the next entry of the ring with an atomic
+ * increment and fills it in, so it never allocates or takes a lock and is
+ * cheap enough to leave on. The sequence number of an entry is stored last,
+ * which lets a dump skip entries that were being written when it started.
+ *
+ * The ring is written to flight_<pid>.log when the controller detects that
+ * a disk has failed, when the process receives a fatal signal, and on
+ * SIGUSR1, which dumps without stopping a process that seems to hang. The
+ * dump runs in signal handlers, so it only uses async-signal-safe calls and
+ * formats its numbers by hand.
+ */
+
+typedef struct {
+    unsigned long long seq;     // Index of the event plus one; 0 while unused
+    long long time_ns;
+    int type;
+    int disk;
+    int block;
+    int arg;
+} flight_event_t;
+
+static const char *event_names[FLIGHT_TYPES] = {
+    "send_read", "send_write", "reply", "read", "write", "read_failed", "write_failed",
+    "disk_failed", "rebuild_start", "rebuild_done", "checkpoint",
+    "serve_read", "serve_write", "serve_checkpoint", "serve_exit"
+};
+
+static flight_event_t ring[FLIGHT_EVENTS];
+static unsigned long long head;         // Number of events ever recorded
+static char role[MAX_NAME] = "raid_sim";
+static char dump_path[MAX_PATH];
+static char alt_stack[1 << 16];         // Lets a stack overflow still be dumped
+
+static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+/* Return the current time of the monotonic clock in nanoseconds.
+ */
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Line buffer of a dump, flushed to fd when it fills
+typedef struct {
+    int fd;
+    int len;
+    char buf[4096];
+} out_t;
+
+static void out_flush(out_t *o) {
+    if (o->len > 0 && write(o->fd, o->buf, o->len) == -1) {
+        o->fd = -1;
+    }
+    o->len = 0;
+}
+
+static void out_str(out_t *o, const char *s) {
+    for (; *s != '\0'; s++) {
+        if (o->len == (int)sizeof(o->buf)) {
+            out_flush(o);
+        }
+        o->buf[o->len++] = *s;
+    }
+}
+
+static void out_num(out_t *o, long long n) {
+    char digits[24];
+    int i = sizeof(digits) - 1;
+    unsigned long long u = n < 0 ? -(unsigned long long)n : (unsigned long long)n;
+    digits[i] = '\0';
+    do {
+        digits[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (n < 0) {
+        digits[--i] = '-';
+    }
+    out_str(o, digits + i);
+}
+
+/* Write the ring to the dump file, oldest event first, with the time of
+ * each event in microseconds before the dump. reason says why it was taken.
+ *
+ * Only async-signal-safe calls are made, so this may run in a handler.
+ */
+static void dump(const char *reason) {
+    out_t o;
+    o.fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    o.len = 0;
+    if (o.fd == -1) {
+        return;
+    }
+    long long now = now_ns();
+    unsigned long long end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    unsigned long long begin = end > FLIGHT_EVENTS ? end - FLIGHT_EVENTS : 0;
+
+    out_str(&o, "flight recorder of ");
+    out_str(&o, role);
+    out_str(&o, " pid ");
+    out_num(&o, getpid());
+    out_str(&o, ": ");
+    out_str(&o, reason);
+    out_str(&o, ", last ");
+    out_num(&o, end - begin);
+    out_str(&o, " of ");
+    out_num(&o, end);
+    out_str(&o, " events\nus_ago event disk block arg\n");
+    for (unsigned long long i = begin; i < end; i++) {
+        flight_event_t *e = &ring[i % FLIGHT_EVENTS];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            continue;
+        }
+        out_num(&o, (now - e->time_ns) / 1000);
+        out_str(&o, " ");
+        out_str(&o, e->type >= 0 && e->type < FLIGHT_TYPES ? event_names[e->type] : "?");
+        out_str(&o, " ");
+        out_num(&o, e->disk);
+        out_str(&o, " ");
+        out_num(&o, e->block);
+        out_str(&o, " ");
+        out_num(&o, e->arg);
+        out_str(&o, "\n");
+    }
+    out_flush(&o);
+    if (o.fd != -1) {
+        close(o.fd);
+    }
+}
+
+/* Dump the ring on SIGUSR1 and carry on.
+ */
+static void handle_dump_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    dump("SIGUSR1");
+    errno = saved;
+}
+
+/* Dump the ring on a fatal signal, then let the signal terminate the
+ * process as it would have without the recorder.
+ */
+static void handle_fatal_signal(int sig) {
+    const char *reason = sig == SIGSEGV ? "SIGSEGV" : sig == SIGBUS ? "SIGBUS" : sig == SIGFPE ? "SIGFPE"
+                       : sig == SIGILL ? "SIGILL" : "SIGABRT";
+    dump(reason);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Start a new recording for the process, whose kind is given by name (for
+ * example "disk 3"), and install the handlers that dump it. A forked
+ * process calls this again so that it does not dump the events of its
+ * parent under its parent's pid.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int flight_init(const char *name) {
+    snprintf(role, sizeof(role), "%s", name);
+    __atomic_store_n(&head, 0, __ATOMIC_RELAXED);
+    memset(ring, 0, sizeof(ring));
+    snprintf(dump_path, sizeof(dump_path), "flight_%d.log", (int)getpid());
+
+    stack_t ss;
+    memset(&ss, 0, sizeof(ss));
+    ss.ss_sp = alt_stack;
+    ss.ss_size = sizeof(alt_stack);
+    if (sigaltstack(&ss, NULL) == -1) {
+        perror("sigaltstack");
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = handle_fatal_signal;
+    sa.sa_flags = SA_ONSTACK | SA_RESETHAND;
+    for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++) {
+        if (sigaction(fatal_signals[i], &sa, NULL) == -1) {
+            perror("sigaction");
+            return -1;
+        }
+    }
+    sa.sa_handler = handle_dump_signal;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
+
+/* Record an event of type about block on disk_num, with an argument whose
+ * meaning depends on the type (for instance the latency in microseconds of
+ * a finished request). Use -1 for fields that do not apply.
+ */
+void flight_record(int type, int disk_num, int block, int arg) {
+    unsigned long long i = __atomic_fetch_add(&head, 1, __ATOMIC_RELAXED);
+    flight_event_t *e = &ring[i % FLIGHT_EVENTS];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    e->time_ns = now_ns();
+    e->type = type;
+    e->disk = disk_num;
+    e->block = block;
+    e->arg = arg;
+    __atomic_store_n(&e->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/* Write the ring to flight_<pid>.log now, giving reason as the cause, and
+ * say where it went.
+ */
+void flight_dump(const char *reason) {
+    dump(reason);
+    fprintf(stderr, "Flight recorder written to %s\n", dump_path);
+}
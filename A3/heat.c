@@ -0,0 +1,171 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include "raid.h"
+
+/*
+ * This file tracks how often each extent of the array is accessed, where an
+ * extent is the num_disks blocks of one stripe. The counts are kept in a
+ * count-min sketch of HEAT_DEPTH rows of HEAT_WIDTH counters, so its size
+ * does not depend on the size of the array. An extent is counted in one
+ * counter of each row, and its heat is the smallest of those counters,
+ * which can overestimate but never underestimate the true count.
+ *
+ * Every HEAT_HALF_LIFE accesses all counters are halved, so the heat of an
+ * extent reflects its recent accesses and extents that cool down are
+ * forgotten. An extent is hot when its heat is more than HEAT_HOT_FACTOR
+ * times the mean heat, or than HEAT_HOT_FACTOR while the mean is below 1, so
+ * a single pass over the array, such as a scan, leaves every extent cold
+ * however long the pass is.
+ *
+ * Accesses are counted under a lock, since worker threads count theirs at
+ * the same time.
+ */
+
+static unsigned short sketch[HEAT_DEPTH][HEAT_WIDTH];
+static long long accesses;
+static long long total_heat;        // Sum of all heat, halved with the counters
+static pthread_mutex_t heat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Odd multipliers that give each row of the sketch its own hash
+static const unsigned long long row_seed[HEAT_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+};
+
+/* Return the counter of extent in row of the sketch.
+ */
+static unsigned short *counter(int row, int extent) {
+    unsigned long long h = ((unsigned long long)extent + 1) * row_seed[row];
+    return &sketch[row][(h >> 32) % HEAT_WIDTH];
+}
+
+/* Return the heat of the extent that holds block_num.
+ */
+int heat_of(int block_num) {
+    int extent = block_num / num_disks;
+    int heat = *counter(0, extent);
+    for (int row = 1; row < HEAT_DEPTH; row++) {
+        if (*counter(row, extent) < heat) {
+            heat = *counter(row, extent);
+        }
+    }
+    return heat;
+}
+
+/* Count an access to block_num. Only the counters that hold the current
+ * minimum are incremented (a conservative update), which keeps the
+ * overestimate from collisions small. Without a cache tier nothing reads
+ * the heat, so accesses are not counted.
+ */
+void heat_touch(int block_num) {
+    if (!tier_enabled()) {
+        return;
+    }
+    int extent = block_num / num_disks;
+    pthread_mutex_lock(&heat_lock);
+    int heat = heat_of(block_num);
+    for (int row = 0; row < HEAT_DEPTH; row++) {
+        unsigned short *c = counter(row, extent);
+        if (*c == heat && *c < 0xffff) {
+            (*c)++;
+        }
+    }
+    total_heat++;
+
+    if (++accesses % HEAT_HALF_LIFE == 0) {
+        total_heat >>= 1;
+        for (int row = 0; row < HEAT_DEPTH; row++) {
+            for (int i = 0; i < HEAT_WIDTH; i++) {
+                sketch[row][i] >>= 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&heat_lock);
+}
+
+/* Return the total heat that the hot threshold is based on. The mean heat
+ * is taken to be at least 1, so that the first extents touched after a cold
+ * start or a halving do not count as hot on a single access.
+ */
+static long long threshold_heat(int num_extents) {
+    return total_heat > num_extents ? total_heat : num_extents;
+}
+
+/* Return 1 if the extent that holds block_num is hot and 0 otherwise.
+ */
+int heat_is_hot(int block_num) {
+    int num_extents = (disk_size / block_size + num_disks - 1) / num_disks;
+    return (long long)heat_of(block_num) * num_extents > HEAT_HOT_FACTOR * threshold_heat(num_extents);
+}
+
+/* Print a map of the heat of the whole array, one character per group of
+ * extents, followed by the hottest extents and how much of each the cache
+ * tier holds.
+ */
+void print_heat_map() {
+    static const char shades[] = " .:-=+*#%@";
+    if (!tier_enabled()) {
+        printf("No cache tier, so heat is not tracked\n");
+        return;
+    }
+    int num_extents = (disk_size / block_size + num_disks - 1) / num_disks;
+    int per_cell = (num_extents + HEAT_MAP_COLUMNS - 1) / HEAT_MAP_COLUMNS;
+    int cells = (num_extents + per_cell - 1) / per_cell;
+
+    int max_heat = 0;
+    for (int e = 0; e < num_extents; e++) {
+        int heat = heat_of(e * num_disks);
+        max_heat = heat > max_heat ? heat : max_heat;
+    }
+    printf("heat: %lld accesses, %d extents of %d blocks, counters halved every %d accesses, hot above %.1f\n",
+           accesses, num_extents, num_disks, HEAT_HALF_LIFE, (double)HEAT_HOT_FACTOR * threshold_heat(num_extents) / num_extents);
+
+    // Each cell shows the hottest of its extents relative to the hottest overall
+    char map[HEAT_MAP_COLUMNS + 1];
+    for (int cell = 0; cell < cells; cell++) {
+        int heat = 0;
+        for (int e = cell * per_cell; e < (cell + 1) * per_cell && e < num_extents; e++) {
+            int h = heat_of(e * num_disks);
+            heat = h > heat ? h : heat;
+        }
+        int shade = max_heat > 0 ? (heat * (int)(sizeof(shades) - 2) + max_heat - 1) / max_heat : 0;
+        map[cell] = shades[shade];
+    }
+    map[cells] = '\0';
+    printf("map (%d extents per column, max heat %d): [%s]\n", per_cell, max_heat, map);
+
+    // Selection of the hottest extents, without allocating
+    int last_heat = 0x10000, last_extent = -1;
+    for (int n = 0; n < HEAT_TOP_EXTENTS; n++) {
+        int best = -1, best_heat = 0;
+        for (int e = 0; e < num_extents; e++) {
+            int h = heat_of(e * num_disks);
+            int below = h < last_heat || (h == last_heat && e > last_extent);
+            if (below && h > best_heat) {
+                best = e;
+                best_heat = h;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        printf("  extent %6d (blocks %d-%d): heat %5d", best, best * num_disks, best * num_disks + num_disks - 1, best_heat);
+        if (tier_enabled()) {
+            printf(", %d/%d blocks in tier", tier_extent_blocks(best), num_disks);
+        }
+        printf("\n");
+        last_heat = best_heat;
+        last_extent = best;
+    }
+}
@@ -0,0 +1,535 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include "raid.h"
+
+/*
+ * This file contains the descriptor and timing helpers shared by the
+ * controller and the disk processes. Stream sockets may return fewer bytes
+ * than requested, so every message is moved with read_full and write_full
+ * rather than a single read or write call.
+ *
+ * Disks may also be reached over TCP at a host:port endpoint, which lets
+ * them run as daemons on other machines.
+ *
+ * A local disk may instead be reached over a SOCK_SEQPACKET socketpair,
+ * which keeps the boundary of every message: a request or reply is one
+ * system call however it is read, and requests queued on a channel can be
+ * sent and received many at a time with sendmmsg and recvmmsg.
+ *
+ * With the splice transport the channels are pipes, but the data of a write
+ * is not copied through them: vmsplice hands the pages of the controller's
+ * buffer to the pipe and splice moves them into the disk's image file.
+ */
+
+// Requests received from a seqpacket channel by one recvmmsg call and not
+// yet handed out by read_channel. A process serves one channel at a time.
+static char *queue_data;                // IPC_BATCH slots of queue_slot bytes
+static size_t queue_slot;
+static unsigned int queue_len[IPC_BATCH];
+static int queue_count, queue_next;
+static size_t queue_pos;
+
+/* Return the current time of the monotonic clock in milliseconds.
+ */
+double monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Read exactly n bytes from fd into buf, retrying on short reads.
+ *
+ * Returns n on success, 0 if end-of-file is reached before any byte was read,
+ * and -1 on error or on end-of-file part way through the message.
+ */
+ssize_t read_full(int fd, void *buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = read(fd, (char *)buf + done, n - done);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return done == 0 ? 0 : -1;
+        }
+        done += r;
+    }
+    return done;
+}
+
+/* Write exactly n bytes from buf to fd, retrying on short writes.
+ *
+ * Returns n on success and -1 on error.
+ */
+ssize_t write_full(int fd, const void *buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t w = write(fd, (const char *)buf + done, n - done);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += w;
+    }
+    return done;
+}
+
+/* Write all count buffers described by iov to fd with as few system calls
+ * as possible, retrying on short writes. iov is modified.
+ *
+ * Returns the number of bytes written on success and -1 on error.
+ */
+ssize_t writev_full(int fd, struct iovec *iov, int count) {
+    ssize_t done = 0;
+    while (count > 0) {
+        ssize_t w = writev(fd, iov, count);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += w;
+        // Skip the buffers that were written completely
+        while (count > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return done;
+}
+
+/* Store the name of the socket that disk id listens on in path.
+ *
+ * Returns 0 on success and -1 if the name does not fit in len bytes.
+ */
+int disk_socket_path(char *path, size_t len, int id) {
+    if (snprintf(path, len, "%s/disk_%d.sock", socket_dir, id) >= (int)len) {
+        fprintf(stderr, "Error: Socket name too long for disk %d\n", id);
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill addr with the Unix domain address for path.
+ *
+ * Returns 0 on success and -1 if path is too long for sun_path.
+ */
+static int make_unix_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* Create a Unix stream socket bound to path and listening for connections.
+ * Any stale socket file left at path is removed first.
+ *
+ * Returns the listening descriptor on success and -1 on failure.
+ */
+int unix_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (make_unix_addr(&addr, path) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 1) == -1) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Connect to the Unix stream socket at path.
+ *
+ * Returns the connected descriptor on success and -1 on failure, with errno
+ * left set by connect so callers can tell a missing socket from other errors.
+ */
+int unix_connect(const char *path) {
+    struct sockaddr_un addr;
+    if (make_unix_addr(&addr, path) == -1) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+/* Disable Nagle's algorithm on the TCP socket fd so that small requests are
+ * sent at once instead of waiting for the previous reply to be acknowledged.
+ * This has no effect on other kinds of socket.
+ */
+void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* Resolve the host:port endpoint into a list of addresses in res. An empty
+ * host means every local address, for listening.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int resolve_endpoint(const char *endpoint, int passive, struct addrinfo **res) {
+    char host[MAX_PATH];
+    const char *colon = strrchr(endpoint, ':');
+    if (colon == NULL || (size_t)(colon - endpoint) >= sizeof(host)) {
+        fprintf(stderr, "Error: Endpoint %s is not of the form host:port\n", endpoint);
+        return -1;
+    }
+    memcpy(host, endpoint, colon - endpoint);
+    host[colon - endpoint] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    int err = getaddrinfo(host[0] != '\0' ? host : NULL, colon + 1, &hints, res);
+    if (err != 0) {
+        fprintf(stderr, "Error: Cannot resolve %s: %s\n", endpoint, gai_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/* Create a TCP socket bound to the host:port endpoint and listening for
+ * connections.
+ *
+ * Returns the listening descriptor on success and -1 on failure.
+ */
+int tcp_listen(const char *endpoint) {
+    struct addrinfo *res;
+    if (resolve_endpoint(endpoint, 1, &res) == -1) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        // A restarted disk must be able to reuse its port at once
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(fd, 1) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        perror(endpoint);
+    }
+    return fd;
+}
+
+/* Connect to the TCP endpoint host:port.
+ *
+ * Returns the connected descriptor on success and -1 on failure, with errno
+ * left set by connect.
+ */
+int tcp_connect(const char *endpoint) {
+    struct addrinfo *res;
+    if (resolve_endpoint(endpoint, 0, &res) == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = -1;
+    int saved = 0;
+    for (struct addrinfo *ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            saved = errno;
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+            saved = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        errno = saved;
+        return -1;
+    }
+    set_nodelay(fd);
+    return fd;
+}
+
+/* Create the channels to a local disk of the given kind. to_disk carries
+ * requests and from_disk replies, and as with pipe [0] is the read end and
+ * [1] the write end of each. A seqpacket channel is a single socketpair
+ * whose ends are duplicated, so that every end can be closed on its own.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int open_channel(transport_t kind, int to_disk[2], int from_disk[2]) {
+    if (kind != TRANSPORT_SEQPACKET) {
+        if (pipe(to_disk) == -1) {
+            perror("pipe");
+            return -1;
+        }
+        if (pipe(from_disk) == -1) {
+            perror("pipe");
+            close(to_disk[0]);
+            close(to_disk[1]);
+            return -1;
+        }
+        // Let a whole block fit in the pipe; the default size is kept if
+        // the system does not allow a larger one
+        if (kind == TRANSPORT_SPLICE && block_size > fcntl(to_disk[1], F_GETPIPE_SZ)) {
+            fcntl(to_disk[1], F_SETPIPE_SZ, block_size + (int)sizeof(request_header_t));
+        }
+        return 0;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    int controller_dup = dup(sv[0]);
+    int disk_dup = dup(sv[1]);
+    if (controller_dup == -1 || disk_dup == -1) {
+        perror("dup");
+        close(sv[0]);
+        close(sv[1]);
+        if (controller_dup != -1) {
+            close(controller_dup);
+        }
+        if (disk_dup != -1) {
+            close(disk_dup);
+        }
+        return -1;
+    }
+    to_disk[1] = sv[0];
+    from_disk[0] = controller_dup;
+    to_disk[0] = sv[1];
+    from_disk[1] = disk_dup;
+    return 0;
+}
+
+/* Receive the requests waiting on the seqpacket channel fd, at least one
+ * and at most IPC_BATCH, into the queue.
+ *
+ * Returns the number received, 0 if the channel was closed, and -1 on
+ * error or if a request did not fit in a slot.
+ */
+static int receive_requests(int fd) {
+    if (queue_data == NULL) {
+        queue_slot = sizeof(request_header_t) + block_size;
+        queue_data = malloc(IPC_BATCH * queue_slot);
+        if (queue_data == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    struct mmsghdr msgs[IPC_BATCH];
+    struct iovec iov[IPC_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < IPC_BATCH; i++) {
+        iov[i].iov_base = queue_data + i * queue_slot;
+        iov[i].iov_len = queue_slot;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int r;
+    do {
+        r = recvmmsg(fd, msgs, IPC_BATCH, MSG_WAITFORONE, NULL);
+    } while (r == -1 && errno == EINTR);
+    if (r == -1) {
+        return -1;
+    }
+
+    // An empty message marks the end of the channel
+    queue_count = 0;
+    while (queue_count < r && msgs[queue_count].msg_len > 0) {
+        if (msgs[queue_count].msg_hdr.msg_flags & MSG_TRUNC) {
+            fprintf(stderr, "read_channel: request larger than %zu bytes\n", queue_slot);
+            return -1;
+        }
+        queue_len[queue_count] = msgs[queue_count].msg_len;
+        queue_count++;
+    }
+    queue_next = 0;
+    queue_pos = 0;
+    return queue_count;
+}
+
+/* Read exactly n bytes of the requests arriving on fd into buf. If packets
+ * is set, fd is a seqpacket channel whose requests are received in batches
+ * and handed out in order; otherwise this is read_full.
+ *
+ * Returns n on success, 0 if the channel is closed before any byte was
+ * read, and -1 on error or if it is closed part way through.
+ */
+ssize_t read_channel(int fd, void *buf, size_t n, int packets) {
+    if (!packets) {
+        return read_full(fd, buf, n);
+    }
+    size_t done = 0;
+    while (done < n) {
+        if (queue_next == queue_count) {
+            int r = receive_requests(fd);
+            if (r <= 0) {
+                return r == 0 && done == 0 ? 0 : -1;
+            }
+        }
+        size_t left = queue_len[queue_next] - queue_pos;
+        size_t take = n - done < left ? n - done : left;
+        memcpy((char *)buf + done, queue_data + queue_next * queue_slot + queue_pos, take);
+        done += take;
+        queue_pos += take;
+        if (queue_pos == queue_len[queue_next]) {
+            queue_next++;
+            queue_pos = 0;
+        }
+    }
+    return done;
+}
+
+/* Send count requests to fd, request i being the two buffers iov[2 * i]
+ * and iov[2 * i + 1]. If packets is set, fd is a seqpacket channel and each
+ * request is a message of its own, sent IPC_BATCH at a time by sendmmsg;
+ * otherwise they are all written by writev_full. iov may be modified.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int write_requests(int fd, struct iovec *iov, int count, int packets) {
+    if (!packets) {
+        ssize_t total = 0;
+        for (int i = 0; i < 2 * count; i++) {
+            total += iov[i].iov_len;
+        }
+        return writev_full(fd, iov, 2 * count) == total ? 0 : -1;
+    }
+
+    struct mmsghdr msgs[IPC_BATCH];
+    int sent = 0;
+    while (sent < count) {
+        int batch = count - sent < IPC_BATCH ? count - sent : IPC_BATCH;
+        memset(msgs, 0, batch * sizeof(msgs[0]));
+        for (int i = 0; i < batch; i++) {
+            msgs[i].msg_hdr.msg_iov = &iov[2 * (sent + i)];
+            msgs[i].msg_hdr.msg_iovlen = 2;
+        }
+        int r = sendmmsg(fd, msgs, batch, 0);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        sent += r;
+    }
+    return 0;
+}
+
+/* Hand the n bytes at buf to the pipe fd with vmsplice, which passes
+ * references to the pages of buf rather than copying them. buf must not
+ * change until the reader has taken the bytes out of the pipe.
+ *
+ * Returns n on success and -1 on error.
+ */
+ssize_t vmsplice_full(int fd, const void *buf, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        struct iovec iov = { (char *)buf + done, n - done };
+        ssize_t w = vmsplice(fd, &iov, 1, 0);
+        if (w == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += w;
+    }
+    return done;
+}
+
+/* Move exactly n bytes from the pipe fd into the file out_fd at offset
+ * with splice, without copying them through user space.
+ *
+ * Returns n on success and -1 on error or if the pipe is closed first.
+ */
+ssize_t splice_full(int fd, int out_fd, long long offset, size_t n) {
+    loff_t off = offset;
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = splice(fd, NULL, out_fd, &off, n - done, SPLICE_F_MOVE);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (r == 0) {
+            return -1;
+        }
+        done += r;
+    }
+    return done;
+}
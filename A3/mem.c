@@ -0,0 +1,95 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "raid.h"
+
+/*
+ * This file implements the allocator for large, long-lived regions such as
+ * disk images and the controller's buffer pool. With huge pages enabled, a
+ * region is backed by explicit huge pages from hugetlbfs if the system has
+ * any reserved, and otherwise by transparent huge pages, which cuts the
+ * number of TLB misses when blocks are accessed at random.
+ *
+ * Regions start on a page boundary either way, so that the blocks of a
+ * region whose block size is a multiple of the page size can be handed to a
+ * pipe whole by vmsplice.
+ */
+
+/* Round size up to a whole number of huge pages.
+ */
+static size_t huge_round(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+}
+
+/* Round size up to a whole number of normal pages.
+ */
+static size_t page_round(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) & ~(page - 1);
+}
+
+/* Allocate a zero-filled region of size bytes. If huge is non-zero the
+ * region is backed by huge pages where the system allows it.
+ *
+ * Returns a pointer to the region on success and NULL on failure.
+ * The region must be released with free_region using the same size and huge.
+ */
+void *alloc_region(size_t size, int huge) {
+    if (!huge) {
+        void *p = mmap(NULL, page_round(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            return NULL;
+        }
+        return p;
+    }
+
+    size_t len = huge_round(size);
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        if (debug) {
+            fprintf(stderr, "Allocated %zu bytes of hugetlbfs pages\n", len);
+        }
+        return p;
+    }
+
+    // No reserved huge pages, so ask for transparent huge pages instead
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (madvise(p, len, MADV_HUGEPAGE) == -1) {
+        if (debug) {
+            fprintf(stderr, "Huge pages unavailable, using normal pages for %zu bytes\n", len);
+        }
+    } else if (debug) {
+        fprintf(stderr, "Allocated %zu bytes of transparent huge pages\n", len);
+    }
+    return p;
+}
+
+/* Release a region of size bytes allocated by alloc_region with huge.
+ */
+void free_region(void *p, size_t size, int huge) {
+    if (p == NULL) {
+        return;
+    }
+    if (munmap(p, huge ? huge_round(size) : page_round(size)) == -1) {
+        perror("munmap");
+    }
+}
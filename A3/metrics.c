@@ -0,0 +1,424 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "raid.h"
+
+/*
+ * This file collects the metrics of the array and serves them in the
+ * Prometheus text format.
+ *
+ * The counters live in a segment of shared memory that is mapped before
+ * any other process is forked. It is divided into slots, and each slot has
+ * a single writer, which updates its counters with plain relaxed stores and
+ * never takes a lock. A metrics server process, forked at startup, adds the
+ * slots together each time it is scraped, so reading the metrics never
+ * slows down the requests being counted.
+ *
+ * The server answers HTTP GET requests on a Unix socket (an endpoint that
+ * contains a '/') or on a TCP host:port endpoint, for example
+ * "curl --unix-socket /tmp/raid.metrics http://x/metrics" or
+ * "curl http://localhost:9209/metrics".
+ */
+
+static const char *op_names[METRICS_OPS] = {"read", "write"};
+
+static metrics_t *metrics;
+static pid_t server_pid = -1;
+static double sent_ms[METRICS_MAX_DISKS];  // Time of the last read sent to each disk
+static __thread int slot_index;            // Slot of the calling thread, 0 for the main thread
+
+/* Store value in the counter c. Each counter has a single writer, so a
+ * relaxed store is enough to keep a concurrent scrape from seeing a torn
+ * value.
+ */
+static void set_counter(long long *c, long long value) {
+    __atomic_store_n(c, value, __ATOMIC_RELAXED);
+}
+
+/* Return the value of the counter c written by another process.
+ */
+static long long get_counter(const long long *c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/* Return the slot of the calling thread.
+ */
+static metrics_slot_t *my_slot() {
+    return &metrics->slots[slot_index];
+}
+
+/* Give the calling thread slot index of the segment, which no other thread
+ * may write to.
+ */
+void metrics_thread(int index) {
+    slot_index = index % METRICS_SLOTS;
+}
+
+/* Map the shared segment that the metrics are kept in. This must be called
+ * before any other process is forked. If path is not NULL the segment is
+ * backed by the file path, so that raidtop can map it too.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int init_metrics(const char *path) {
+    int fd = -1;
+    int flags = MAP_SHARED | MAP_ANONYMOUS;
+    if (path != NULL) {
+        // The file is not truncated, since a raidtop may still have it mapped
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd == -1 || ftruncate(fd, sizeof(metrics_t)) == -1) {
+            perror(path);
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        flags = MAP_SHARED;
+    }
+    metrics = mmap(NULL, sizeof(metrics_t), PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (metrics == MAP_FAILED) {
+        perror("mmap");
+        metrics = NULL;
+        return -1;
+    }
+    if (path != NULL) {
+        // Clear the counters of an earlier run, hiding them from readers first
+        __atomic_store_n(&metrics->state.magic, 0, __ATOMIC_RELEASE);
+        memset(metrics, 0, sizeof(metrics_t));
+    }
+    metrics_state_t *state = &metrics->state;
+    state->pid = getpid();
+    state->num_disks = num_disks;
+    state->num_parity = num_parity;
+    state->total_disks = num_disks + num_parity + (tier_blocks > 0 ? TIER_DISKS : 0);
+    state->block_size = block_size;
+    state->tier_blocks = tier_blocks;
+    state->rebuild_disk = -1;
+    state->start_ms = monotonic_ms();
+    // Readers check the magic number last, once the rest is in place
+    __atomic_store_n(&state->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Return the bucket of the latency histograms that us microseconds falls
+ * in: bucket b counts latencies of at most 2^b microseconds.
+ */
+static int latency_bucket(long long us) {
+    int b = 0;
+    while (b < METRICS_BUCKETS - 1 && us > (1LL << b)) {
+        b++;
+    }
+    return b;
+}
+
+/* Count a request of type write (0 for a read) for bytes bytes that took
+ * latency_ms to complete, and whether it failed.
+ */
+void metrics_request(int write, int bytes, double latency_ms, int failed) {
+    if (metrics == NULL) {
+        return;
+    }
+    metrics_slot_t *s = my_slot();
+    int op = write ? METRICS_WRITE : METRICS_READ;
+    long long us = (long long)(latency_ms * 1000.0);
+    int b = latency_bucket(us);
+    set_counter(&s->requests[op], s->requests[op] + 1);
+    set_counter(&s->bytes[op], s->bytes[op] + bytes);
+    set_counter(&s->errors[op], s->errors[op] + (failed != 0));
+    set_counter(&s->latency_us_sum[op], s->latency_us_sum[op] + us);
+    set_counter(&s->latency_buckets[op][b], s->latency_buckets[op][b] + 1);
+}
+
+/* Count a request of type write sent to disk disk_num. A read stays in the
+ * disk's queue until metrics_disk_reply is called for its reply.
+ */
+void metrics_disk_send(int disk_num, int write) {
+    if (metrics == NULL || disk_num >= METRICS_MAX_DISKS) {
+        return;
+    }
+    metrics_slot_t *s = my_slot();
+    long long *c = &s->disk_requests[disk_num][write ? METRICS_WRITE : METRICS_READ];
+    set_counter(c, *c + 1);
+    if (!write) {
+        sent_ms[disk_num] = monotonic_ms();
+        set_counter(&s->disk_queue[disk_num], s->disk_queue[disk_num] + 1);
+        set_counter(&s->queue_depth, s->queue_depth + 1);
+        if (s->queue_depth > s->max_queue_depth) {
+            set_counter(&s->max_queue_depth, s->queue_depth);
+        }
+    }
+}
+
+/* Count the reply to a read sent to disk disk_num and how long the disk
+ * took to answer it. The controller never has more than one read
+ * outstanding on a disk, since the disk's lock is held until the reply, so
+ * the time of the last send is enough.
+ */
+void metrics_disk_reply(int disk_num) {
+    if (metrics == NULL || disk_num >= METRICS_MAX_DISKS) {
+        return;
+    }
+    metrics_slot_t *s = my_slot();
+    int b = latency_bucket((long long)((monotonic_ms() - sent_ms[disk_num]) * 1000.0));
+    set_counter(&s->disk_latency_buckets[disk_num][b], s->disk_latency_buckets[disk_num][b] + 1);
+    set_counter(&s->disk_queue[disk_num], s->disk_queue[disk_num] - 1);
+    set_counter(&s->queue_depth, s->queue_depth - 1);
+}
+
+/* Return the number of requests sent to disk disk_num so far.
+ */
+long long metrics_disk_total(int disk_num) {
+    long long total = 0;
+    if (metrics == NULL || disk_num >= METRICS_MAX_DISKS) {
+        return 0;
+    }
+    for (int i = 0; i < METRICS_SLOTS; i++) {
+        for (int op = 0; op < METRICS_OPS; op++) {
+            total += get_counter(&metrics->slots[i].disk_requests[disk_num][op]);
+        }
+    }
+    return total;
+}
+
+/* Count a read that hit the cache tier if hit is set, or missed it.
+ */
+void metrics_tier(int hit) {
+    if (metrics == NULL) {
+        return;
+    }
+    long long *c = hit ? &my_slot()->tier_hits : &my_slot()->tier_misses;
+    set_counter(c, *c + 1);
+}
+
+/* Record whether disk disk_num has failed.
+ */
+void metrics_disk_failed(int disk_num, int failed) {
+    if (metrics != NULL && disk_num < METRICS_MAX_DISKS) {
+        set_counter(&metrics->state.disk_failed[disk_num], failed);
+    }
+}
+
+/* Record that done of the total units of disk disk_num have been rebuilt.
+ * A disk_num of -1 marks the end of the rebuild.
+ */
+void metrics_rebuild(int disk_num, int done, int total) {
+    if (metrics == NULL) {
+        return;
+    }
+    if (disk_num != -1 && done == total) {
+        set_counter(&metrics->state.rebuilds, metrics->state.rebuilds + 1);
+    }
+    set_counter(&metrics->state.rebuild_disk, disk_num);
+    set_counter(&metrics->state.rebuild_done, done);
+    set_counter(&metrics->state.rebuild_total, total);
+}
+
+/* Write the HELP and TYPE lines of the metric name to fp.
+ */
+static void describe(FILE *fp, const char *name, const char *type, const char *help) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Write every metric, summed over all slots, to fp in the Prometheus text
+ * format.
+ */
+static void write_metrics(FILE *fp) {
+    metrics_slot_t sum;
+    memset(&sum, 0, sizeof(sum));
+    long long *total = (long long *)&sum;
+    for (int i = 0; i < METRICS_SLOTS; i++) {
+        const long long *c = (const long long *)&metrics->slots[i];
+        for (size_t j = 0; j < sizeof(sum) / sizeof(long long); j++) {
+            total[j] += get_counter(&c[j]);
+        }
+    }
+    metrics_state_t *state = &metrics->state;
+    int total_disks = state->total_disks;
+    if (total_disks > METRICS_MAX_DISKS) {
+        total_disks = METRICS_MAX_DISKS;
+    }
+
+    describe(fp, "raid_requests_total", "counter", "Block requests completed by the array.");
+    for (int op = 0; op < METRICS_OPS; op++) {
+        fprintf(fp, "raid_requests_total{op=\"%s\"} %lld\n", op_names[op], sum.requests[op]);
+    }
+    describe(fp, "raid_request_errors_total", "counter", "Block requests that failed.");
+    for (int op = 0; op < METRICS_OPS; op++) {
+        fprintf(fp, "raid_request_errors_total{op=\"%s\"} %lld\n", op_names[op], sum.errors[op]);
+    }
+    describe(fp, "raid_bytes_total", "counter", "Bytes read from and written to the array.");
+    for (int op = 0; op < METRICS_OPS; op++) {
+        fprintf(fp, "raid_bytes_total{op=\"%s\"} %lld\n", op_names[op], sum.bytes[op]);
+    }
+    describe(fp, "raid_request_latency_seconds", "histogram", "Time to complete a block request.");
+    for (int op = 0; op < METRICS_OPS; op++) {
+        long long cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            cumulative += sum.latency_buckets[op][b];
+            if (b < METRICS_BUCKETS - 1) {
+                fprintf(fp, "raid_request_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %lld\n",
+                        op_names[op], (double)(1LL << b) / 1e6, cumulative);
+            }
+        }
+        fprintf(fp, "raid_request_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lld\n", op_names[op], cumulative);
+        fprintf(fp, "raid_request_latency_seconds_sum{op=\"%s\"} %g\n", op_names[op], sum.latency_us_sum[op] / 1e6);
+        fprintf(fp, "raid_request_latency_seconds_count{op=\"%s\"} %lld\n", op_names[op], sum.requests[op]);
+    }
+    describe(fp, "raid_iops", "gauge", "Mean block requests per second since the array started.");
+    double seconds = (monotonic_ms() - state->start_ms) / 1000.0;
+    fprintf(fp, "raid_iops %g\n", seconds > 0 ? (sum.requests[METRICS_READ] + sum.requests[METRICS_WRITE]) / seconds : 0.0);
+
+    describe(fp, "raid_queue_depth", "gauge", "Disk reads sent and not yet answered.");
+    fprintf(fp, "raid_queue_depth %lld\n", sum.queue_depth);
+    describe(fp, "raid_queue_depth_max", "gauge", "Most disk reads outstanding at once.");
+    fprintf(fp, "raid_queue_depth_max %lld\n", sum.max_queue_depth);
+
+    describe(fp, "raid_disk_requests_total", "counter", "Requests sent to each disk.");
+    for (int d = 0; d < total_disks; d++) {
+        for (int op = 0; op < METRICS_OPS; op++) {
+            fprintf(fp, "raid_disk_requests_total{disk=\"%d\",op=\"%s\"} %lld\n", d, op_names[op], sum.disk_requests[d][op]);
+        }
+    }
+    describe(fp, "raid_disk_queue_depth", "gauge", "Reads sent to each disk and not yet answered.");
+    for (int d = 0; d < total_disks; d++) {
+        fprintf(fp, "raid_disk_queue_depth{disk=\"%d\"} %lld\n", d, sum.disk_queue[d]);
+    }
+    describe(fp, "raid_disk_failed", "gauge", "Whether each disk has failed.");
+    for (int d = 0; d < total_disks; d++) {
+        fprintf(fp, "raid_disk_failed{disk=\"%d\"} %lld\n", d, get_counter(&state->disk_failed[d]));
+    }
+
+    if (tier_blocks > 0) {
+        long long reads = sum.tier_hits + sum.tier_misses;
+        describe(fp, "raid_tier_reads_total", "counter", "Reads that hit or missed the cache tier.");
+        fprintf(fp, "raid_tier_reads_total{result=\"hit\"} %lld\n", sum.tier_hits);
+        fprintf(fp, "raid_tier_reads_total{result=\"miss\"} %lld\n", sum.tier_misses);
+        describe(fp, "raid_tier_hit_ratio", "gauge", "Fraction of reads served by the cache tier.");
+        fprintf(fp, "raid_tier_hit_ratio %g\n", reads > 0 ? (double)sum.tier_hits / reads : 0.0);
+    }
+
+    long long rebuild_total = get_counter(&state->rebuild_total);
+    describe(fp, "raid_rebuild_disk", "gauge", "Disk being rebuilt, or -1.");
+    fprintf(fp, "raid_rebuild_disk %lld\n", get_counter(&state->rebuild_disk));
+    describe(fp, "raid_rebuild_progress_ratio", "gauge", "Fraction of the disk being rebuilt that is done.");
+    fprintf(fp, "raid_rebuild_progress_ratio %g\n",
+            rebuild_total > 0 ? (double)get_counter(&state->rebuild_done) / rebuild_total : 0.0);
+    describe(fp, "raid_rebuilds_total", "counter", "Disk rebuilds completed.");
+    fprintf(fp, "raid_rebuilds_total %lld\n", get_counter(&state->rebuilds));
+}
+
+/* Answer one HTTP request on the connection fd with the current metrics.
+ * The request itself is read and ignored, so every path returns them.
+ */
+static void serve_scrape(int fd) {
+    char request[1024];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, METRICS_TIMEOUT_MS) <= 0 || read(fd, request, sizeof(request)) <= 0) {
+        return;
+    }
+
+    char *body = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&body, &len);
+    if (fp == NULL) {
+        return;
+    }
+    write_metrics(fp);
+    fclose(fp);
+
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+    if (write_full(fd, header, n) == n) {
+        write_full(fd, body, len);
+    }
+    free(body);
+}
+
+/* Accept scrapes on listen_fd until the controller exits.
+ */
+static void run_metrics_server(int listen_fd) {
+    // Go away with the controller even if it is killed
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    flight_init("metrics server");
+    signal(SIGINT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+        serve_scrape(conn);
+        close(conn);
+    }
+}
+
+/* Start a metrics server process listening on endpoint, which is either
+ * the path of a Unix socket or a TCP host:port.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int start_metrics_server(const char *endpoint) {
+    if (metrics == NULL) {
+        return -1;
+    }
+    int listen_fd = strchr(endpoint, '/') != NULL ? unix_listen(endpoint) : tcp_listen(endpoint);
+    if (listen_fd == -1) {
+        return -1;
+    }
+
+    fflush(stdout);
+    server_pid = fork();
+    if (server_pid == -1) {
+        perror("fork");
+        close(listen_fd);
+        return -1;
+    }
+    if (server_pid == 0) {
+        run_metrics_server(listen_fd);
+    }
+    close(listen_fd);
+    return 0;
+}
+
+/* Stop the metrics server process if there is one.
+ */
+void stop_metrics_server() {
+    if (server_pid == -1) {
+        return;
+    }
+    kill(server_pid, SIGTERM);
+    if (waitpid(server_pid, NULL, 0) == -1) {
+        perror("stop_metrics_server: waitpid");
+    }
+    server_pid = -1;
+}
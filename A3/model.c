@@ -0,0 +1,190 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raid.h"
+
+/*
+ * This file is an analytical model of the throughput of the array, so that
+ * a measured result can be checked against what the design should achieve
+ * and a regression stands out from noise.
+ *
+ * The controller serves one request at a time, so the IOPS of a workload
+ * is the inverse of its mean response time. A request costs a fixed
+ * overhead, the CPU time of each disk access it makes and the latency of
+ * the disk profile once for each round of accesses it waits for:
+ *
+ * - A read makes one access and waits for one round.
+ * - A write of a block reads the other k - 1 data units of its stripe in
+ *   one round, encodes the stripe and writes the block and the m parity
+ *   units without waiting. The next request waits for those writes when it
+ *   reads one of the disks written, which is the case for a following write
+ *   unless it falls in the same column ((k - 1) / k) and for a following
+ *   read whose block is on the written data disk (1 / k).
+ *
+ * The CPU cost of the accesses is added up as if they ran one after the
+ * other, which is exact on a single core and an upper bound on more. The
+ * costs are calibrated on the live array by timing rounds of raw accesses
+ * (see calibrate_model), reads with and without the controller's
+ * bookkeeping and the encoding of a stripe in memory. Predictions for
+ * another geometry scale the encode cost with the number of data and
+ * parity units.
+ */
+
+// Requests used to calibrate each cost
+#define MODEL_CALIBRATE_OPS 2000
+
+/* Return the mean time in microseconds of a read of a random block done
+ * through read_block if full is set, or straight from the capacity disks
+ * otherwise.
+ */
+static double time_reads(char *buf, int full) {
+    int num_blocks = disk_size / block_size;
+    double start = monotonic_ms();
+    for (int i = 0; i < MODEL_CALIBRATE_OPS; i++) {
+        int block_num = rand() % num_blocks;
+        if (full) {
+            read_block(block_num, buf);
+        } else {
+            capacity_read(block_num, buf);
+        }
+    }
+    return (monotonic_ms() - start) * 1000.0 / MODEL_CALIBRATE_OPS;
+}
+
+/* Return the mean time in microseconds of a round of reads of random
+ * stripes from the first n data disks, followed by a round of writes of the
+ * same units if write is set, into units. The reads that follow the writes
+ * in the next round wait for the disks to finish them.
+ *
+ * Returns -1 if an access failed.
+ */
+static double time_rounds(char **units, int n, int write) {
+    int stripes = disk_size / block_size;
+    double total = 0;
+    for (int i = 0; i < MODEL_CALIBRATE_OPS; i++) {
+        int stripe = rand() % stripes;
+        if (write && access_round(stripe, n, units, 0) == -1) {
+            return -1;
+        }
+        double start = monotonic_ms();
+        if ((write && access_round(stripe, n, units, 1) == -1) || access_round(stripe, n, units, 0) == -1) {
+            return -1;
+        }
+        total += monotonic_ms() - start;
+    }
+    return total * 1000.0 / MODEL_CALIBRATE_OPS;
+}
+
+/* Return the mean time in microseconds to encode one stripe of the live
+ * array's code, whose units are in units.
+ */
+static double time_encode(char **units) {
+    code_t c;
+    if (init_code(&c, layout, num_disks, num_parity, group_size) == -1) {
+        return 0;
+    }
+    double start = monotonic_ms();
+    for (int i = 0; i < MODEL_CALIBRATE_OPS; i++) {
+        encode_stripe(&c, units, block_size);
+    }
+    double us = (monotonic_ms() - start) * 1000.0 / MODEL_CALIBRATE_OPS;
+    free_code(&c);
+    return us;
+}
+
+/* Describe the live array in m and calibrate its costs by timing accesses
+ * to it. A read round of one disk costs one read and the disk latency and a
+ * round of all k data disks costs k reads and the latency, which separates
+ * the two; a write round followed by a read round then gives the cost of a
+ * write. The disk latency measured includes the oversleeping of the disks.
+ * The cache tier is bypassed while the accesses run, and every disk must be
+ * up.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int calibrate_model(model_t *m) {
+    int k = num_disks;
+    memset(m, 0, sizeof(*m));
+    m->disks = k;
+    m->parity = num_parity;
+    m->block_size = block_size;
+
+    char *region = malloc((size_t)(k + num_parity) * block_size);
+    if (region == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    char *units[k + num_parity];
+    for (int i = 0; i < k + num_parity; i++) {
+        units[i] = region + (size_t)i * block_size;
+    }
+    set_tier_bypass(1);
+    double one_us = time_rounds(units, 1, 0);
+    double all_us = time_rounds(units, k, 0);
+    double write_us = time_rounds(units, k, 1);
+    double raw_us = time_reads(region, 0);
+    double full_us = time_reads(region, 1);
+    set_tier_bypass(0);
+    if (one_us < 0 || all_us < 0 || write_us < 0) {
+        fprintf(stderr, "Error: Cannot calibrate the model while a disk has failed\n");
+        free(region);
+        return -1;
+    }
+
+    if (k > 1) {
+        m->access_us = (all_us - one_us) / (k - 1);
+        m->disk_us = one_us - m->access_us;
+    } else {
+        m->disk_us = disk_latency_us;
+        m->access_us = one_us - m->disk_us;
+    }
+    m->access_us = m->access_us > 0 ? m->access_us : 0;
+    m->disk_us = m->disk_us > 0 ? m->disk_us : 0;
+    m->write_access_us = (write_us - all_us - m->disk_us) / k;
+    m->write_access_us = m->write_access_us > 0 ? m->write_access_us : 0;
+    m->overhead_us = full_us > raw_us ? full_us - raw_us : 0;
+    m->encode_us = time_encode(units);
+    free(region);
+    return 0;
+}
+
+/* Predict into p the throughput of the array described by m under random
+ * single block requests of which read_pct percent are reads.
+ */
+void predict_model(const model_t *m, int read_pct, model_prediction_t *p) {
+    double k = m->disks, r = read_pct / 100.0, w = 1.0 - r;
+    p->reads_per_write = k - 1;
+    p->writes_per_write = 1 + m->parity;
+
+    p->read_us = m->overhead_us + m->access_us + m->disk_us;
+    double wait = w * (k - 1) / k + r / k;
+    p->write_us = m->overhead_us + p->reads_per_write * m->access_us + p->writes_per_write * m->write_access_us
+                + m->encode_us
+                + (k > 1 ? m->disk_us : 0) + wait * m->disk_us;
+
+    double mean_us = r * p->read_us + w * p->write_us;
+    p->iops = mean_us > 0 ? 1e6 / mean_us : 0;
+    p->mbps = p->iops * m->block_size / 1e6;
+    p->disk_ops = r + w * (p->reads_per_write + p->writes_per_write);
+}
+
+/* Change the geometry of the model m to disks data and parity parity
+ * disks, scaling its encode cost with the size of the code.
+ */
+void reshape_model(model_t *m, int disks, int parity) {
+    m->encode_us = m->encode_us * disks * parity / ((double)m->disks * m->parity);
+    m->disks = disks;
+    m->parity = parity;
+}
@@ -0,0 +1,276 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "raid.h"
+
+/*
+ * This file measures the hardware performance counters of each kind of
+ * operation, so that it can be seen whether a path such as the parity
+ * computation is limited by memory or by the CPU.
+ *
+ * The controller opens one group of PERF_EVENTS counters on itself with
+ * perf_event_open. A region of code is measured by reading the group when
+ * it is entered and again when it is left, so regions may nest. Disk
+ * processes run nothing but their dispatch loop, so each one is measured
+ * with a group opened on its pid, and its counts are divided by the number
+ * of requests the controller has sent it.
+ *
+ * Only user space is counted, which perf_event_paranoid levels up to 2
+ * allow for processes of the same user. The group is led by the task
+ * clock, a software event, so that time per operation is still reported
+ * on machines (such as most virtual machines) that have no hardware
+ * counters; the hardware events that cannot be opened are shown as "-".
+ */
+
+enum { EV_TASK_CLOCK, EV_CYCLES, EV_INSTRUCTIONS, EV_CACHE_MISSES, EV_BRANCH_MISSES };
+
+// Events counted in each group; the first one leads the group
+static const struct {
+    unsigned int type;
+    unsigned long long config;
+} events[PERF_EVENTS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+static const char *region_names[PERF_REGIONS] = {"write_block", "read_block", "parity"};
+
+// Layout of a read of a whole group with PERF_FORMAT_GROUP
+typedef struct {
+    unsigned long long nr;
+    unsigned long long values[PERF_EVENTS];
+} group_read_t;
+
+typedef struct {
+    long long ops;
+    long long bytes;
+    unsigned long long totals[PERF_EVENTS];
+} region_stats_t;
+
+static int perf_on;
+static int available[PERF_EVENTS];  // Events the controller could open
+static int num_available;
+static int self_fds[PERF_EVENTS];
+static region_stats_t regions[PERF_REGIONS];
+static int *disk_fds;               // PERF_EVENTS per disk, -1 if not counted
+static long long *disk_base;        // Requests sent to each disk before it was attached
+static int num_perf_disks;
+
+/* Open the counter for event i on the process pid (0 for the calling
+ * thread) in the group led by group_fd, or as a leader if it is -1.
+ *
+ * Returns the descriptor on success and -1 on failure, with errno set.
+ */
+static int open_event(int i, pid_t pid, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, pid, -1, group_fd, 0);
+}
+
+/* Open a group of the available events on the process pid (0 for the
+ * calling thread) into fds, setting the others to -1.
+ *
+ * Returns 0 on success and -1 on failure, with errno set.
+ */
+static int open_group(pid_t pid, int *fds) {
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        fds[i] = -1;
+        if (!available[i]) {
+            continue;
+        }
+        fds[i] = open_event(i, pid, i == 0 ? -1 : fds[0]);
+        if (fds[i] == -1) {
+            int saved = errno;
+            for (int j = 0; j < i; j++) {
+                if (fds[j] != -1) {
+                    close(fds[j]);
+                    fds[j] = -1;
+                }
+            }
+            errno = saved;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read the current values of the group led by fd into values, with zero
+ * for the events that are not available.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int read_group(int fd, unsigned long long *values) {
+    group_read_t r;
+    ssize_t len = sizeof(unsigned long long) * (1 + num_available);
+    if (read(fd, &r, sizeof(r)) != len || r.nr != (unsigned long long)num_available) {
+        return -1;
+    }
+    for (int i = 0, n = 0; i < PERF_EVENTS; i++) {
+        values[i] = available[i] ? r.values[n++] : 0;
+    }
+    return 0;
+}
+
+/* Start counting the controller's own events. Disks are added with
+ * perf_attach_disk as they start.
+ *
+ * Returns 0 on success and -1 if the counters are not available.
+ */
+int init_perf(int total_disks) {
+    // Find out which events this machine has by opening each on its own
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        int fd = open_event(i, 0, -1);
+        if (fd == -1 && i == EV_TASK_CLOCK) {
+            fprintf(stderr, "Error: perf_event_open is unavailable: %s\n", strerror(errno));
+            return -1;
+        }
+        if (fd != -1) {
+            available[i] = 1;
+            num_available++;
+            close(fd);
+        }
+    }
+    if (open_group(0, self_fds) == -1) {
+        fprintf(stderr, "Error: Cannot open the performance counters: %s\n", strerror(errno));
+        return -1;
+    }
+    if (num_available < PERF_EVENTS) {
+        fprintf(stderr, "Warning: Some hardware counters are unavailable; only time is counted for them\n");
+    }
+    disk_fds = malloc(total_disks * PERF_EVENTS * sizeof(int));
+    disk_base = calloc(total_disks, sizeof(long long));
+    if (disk_fds == NULL || disk_base == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (int i = 0; i < total_disks * PERF_EVENTS; i++) {
+        disk_fds[i] = -1;
+    }
+    num_perf_disks = total_disks;
+    perf_on = 1;
+    return 0;
+}
+
+/* Count the events of the process pid as those of disk disk_num, replacing
+ * the counters of any earlier process of that disk. A disk that is not a
+ * local process (pid <= 0) is not counted.
+ */
+void perf_attach_disk(int disk_num, pid_t pid) {
+    if (!perf_on || disk_num >= num_perf_disks) {
+        return;
+    }
+    int *fds = &disk_fds[disk_num * PERF_EVENTS];
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+    disk_base[disk_num] = metrics_disk_total(disk_num);
+    if (pid > 0 && open_group(pid, fds) == -1 && debug) {
+        fprintf(stderr, "Cannot count disk %d: %s\n", disk_num, strerror(errno));
+    }
+}
+
+/* Record the controller's counters in start at the entry of a region.
+ */
+void perf_begin(perf_sample_t *start) {
+    start->valid = perf_on && read_group(self_fds[0], start->values) == 0;
+}
+
+/* Add the events since perf_begin recorded start to region, as one
+ * operation on bytes bytes. An operation whose start could not be read is
+ * left out rather than counted from zero.
+ */
+void perf_end(int region, perf_sample_t *start, int bytes) {
+    unsigned long long now[PERF_EVENTS];
+    if (!perf_on || !start->valid || read_group(self_fds[0], now) == -1) {
+        return;
+    }
+    region_stats_t *r = &regions[region];
+    r->ops++;
+    r->bytes += bytes;
+    for (int i = 0; i < PERF_EVENTS; i++) {
+        r->totals[i] += now[i] - start->values[i];
+    }
+}
+
+/* Print value in a column of width, or "-" if event is not available.
+ */
+static void print_column(int event, int width, int precision, double value) {
+    if (available[event]) {
+        printf(" %*.*f", width, precision, value);
+    } else {
+        printf(" %*s", width, "-");
+    }
+}
+
+/* Print one line of per operation figures for label from the event totals
+ * over ops operations and bytes bytes.
+ */
+static void print_row(const char *label, long long ops, long long bytes, const unsigned long long *totals) {
+    double n = ops > 0 ? ops : 1;
+    printf("%-12s %10lld %10.2f", label, ops, totals[EV_TASK_CLOCK] / n / 1000.0);
+    print_column(EV_CYCLES, 12, 0, totals[EV_CYCLES] / n);
+    print_column(EV_INSTRUCTIONS, 12, 0, totals[EV_INSTRUCTIONS] / n);
+    print_column(available[EV_CYCLES] ? EV_INSTRUCTIONS : EV_CYCLES, 6, 2,
+                 totals[EV_CYCLES] > 0 ? (double)totals[EV_INSTRUCTIONS] / totals[EV_CYCLES] : 0.0);
+    print_column(EV_CACHE_MISSES, 10, 2, totals[EV_CACHE_MISSES] / n);
+    print_column(EV_BRANCH_MISSES, 10, 2, totals[EV_BRANCH_MISSES] / n);
+    print_column(EV_CACHE_MISSES, 10, 2, bytes > 0 ? totals[EV_CACHE_MISSES] * 1024.0 / bytes : 0.0);
+    printf("\n");
+}
+
+/* Print the time, cycles, instructions, instructions per cycle, cache
+ * misses and branch misses per operation of each region and of each disk's
+ * dispatch loop, with the cache misses per KB of data moved. Few
+ * instructions per cycle together with many cache misses per KB marks a
+ * path that is bound by memory rather than by the CPU.
+ */
+void print_perf_stats() {
+    if (!perf_on) {
+        printf("Performance counters are off; start raid_sim with -p\n");
+        return;
+    }
+    printf("%-12s %10s %10s %12s %12s %6s %10s %10s %10s\n",
+           "op", "count", "us/op", "cycles/op", "instr/op", "IPC", "cmiss/op", "bmiss/op", "cmiss/KB");
+    for (int i = 0; i < PERF_REGIONS; i++) {
+        print_row(region_names[i], regions[i].ops, regions[i].bytes, regions[i].totals);
+    }
+    for (int d = 0; d < num_perf_disks; d++) {
+        unsigned long long totals[PERF_EVENTS];
+        if (disk_fds[d * PERF_EVENTS] == -1 || read_group(disk_fds[d * PERF_EVENTS], totals) == -1) {
+            continue;
+        }
+        char label[MAX_NAME];
+        snprintf(label, sizeof(label), "disk %d", d);
+        long long requests = metrics_disk_total(d) - disk_base[d];
+        print_row(label, requests, requests * block_size, totals);
+    }
+}
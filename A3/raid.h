@@ -13,37 +13,320 @@
 #ifndef RAID_H
 #define RAID_H
 
+#include <sys/uio.h>
+#include <pthread.h>
+
 #define DEFAULT_NUM_DISKS 3
 #define DEFAULT_BLOCK_SIZE 16
 #define DEFAULT_DISK_SIZE (16 * DEFAULT_BLOCK_SIZE)
+#define DEFAULT_SHUTDOWN_TIMEOUT 60
 
 #define MAX_NAME 32
+#define MAX_PATH 108
+
+// Checkpoints are written in chunks of this many bytes
+#define CHECKPOINT_CHUNK (1 << 20)
+
+// Size of the huge pages requested for disk images and buffer pools
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Scratch buffers in the controller's pool beyond two per disk
+#define POOL_SPARE_BUFFERS 8
+
+// Writes the secondary may fall behind by before the primary waits, and the
+// most writes shipped in one replication batch
+#define REPL_MAX_LAG 256
+#define REPL_BATCH_BLOCKS 64
+
+// Worker threads that may run requests at once, each with a metrics slot
+// of its own, and the most commands run as one batch
+#define MAX_WORKERS (METRICS_SLOTS - 1)
+#define WORKER_BATCH 256
+
+// Most messages moved by one sendmmsg or recvmmsg call on a seqpacket
+// channel, and the largest block such a message may carry
+#define IPC_BATCH 32
+#define SEQPACKET_MAX_BLOCK (64 << 10)
+
+// Mirrored disks of the cache tier, which follow the capacity disks
+#define TIER_DISKS 2
+
+// The destager runs between commands while more than this fraction of the
+// cache tier is dirty, and destages at most this many stripes each time
+#define TIER_LOW_WATERMARK 0.25
+#define TIER_DESTAGE_BATCH 4
+
+// A block that misses the cache tier is only promoted once its extent is
+// hot, and the rest of the extent is then migrated in the background. At
+// most TIER_MIGRATE_QUEUE extents wait to be migrated.
+#define TIER_MIGRATE_QUEUE 16
+
+// Size of the count-min sketch of extent heat, the number of accesses after
+// which every count is halved, and the shape of the stats heat output
+#define HEAT_DEPTH 4
+#define HEAT_WIDTH 4096
+#define HEAT_HALF_LIFE 8192
+
+// An extent is hot once its heat is this many times the mean heat
+#define HEAT_HOT_FACTOR 4
+#define HEAT_MAP_COLUMNS 64
+#define HEAT_TOP_EXTENTS 8
+
+// Shape of the shared metrics segment: controller threads that have a slot
+// of their own, disks whose requests are counted and latency histogram
+// buckets of 1us to 2^(METRICS_BUCKETS - 2)us. A scrape that sends nothing
+// for METRICS_TIMEOUT_MS is dropped.
+#define METRICS_SLOTS 16
+#define METRICS_MAX_DISKS 64
+#define METRICS_BUCKETS 22
+#define METRICS_TIMEOUT_MS 1000
+
+#define METRICS_MAGIC 0x4d455452 // "METR"
+
+// Operations whose metrics are counted separately
+enum { METRICS_READ, METRICS_WRITE, METRICS_OPS };
+
+// Events counted by perf.c (task clock and four hardware events) and the
+// regions they are counted in
+#define PERF_EVENTS 5
+enum { PERF_WRITE_BLOCK, PERF_READ_BLOCK, PERF_PARITY, PERF_REGIONS };
+
+// Request events kept by the flight recorder of each process (a power of
+// two) and the kinds of event it records
+#define FLIGHT_EVENTS 8192
+enum {
+    FLIGHT_SEND_READ, FLIGHT_SEND_WRITE, FLIGHT_REPLY,
+    FLIGHT_READ, FLIGHT_WRITE, FLIGHT_READ_FAILED, FLIGHT_WRITE_FAILED,
+    FLIGHT_DISK_FAILED, FLIGHT_REBUILD_START, FLIGHT_REBUILD_DONE, FLIGHT_CHECKPOINT,
+    FLIGHT_SERVE_READ, FLIGHT_SERVE_WRITE, FLIGHT_SERVE_CHECKPOINT, FLIGHT_SERVE_EXIT,
+    FLIGHT_TYPES
+};
+
+// Sequential streams that a generated workload can interleave
+#define WORKLOAD_MAX_STREAMS 64
+
+#define SUPERBLOCK_MAGIC 0x52414944 // "RAID"
 
 // Disk controller structure
 typedef struct {
-    pid_t pid;
+    pid_t pid;              // Disk process, or -1 for a disk on another machine
+    int child;              // Set if pid is a child of this controller
     int to_disk[2];         // Pipe for sending commands to disk
     int from_disk[2];       // Pipe for receiving responses from disk
+    int failed;             // Set while the disk's contents must be reconstructed
+    pthread_mutex_t lock;   // Held from a request to its reply
 } disk_controller_t;
 
 // Command types for disk processes
 typedef enum {
     CMD_READ,
     CMD_WRITE,
-    CMD_EXIT
+    CMD_EXIT,
+    CMD_IDENTIFY,
+    CMD_CHECKPOINT
 } disk_command_t;
 
+// Header of a read or write request, sent in one piece ahead of any data
+typedef struct {
+    disk_command_t cmd;
+    int block_num;
+} request_header_t;
+
+// Identity reported by a disk process in reply to CMD_IDENTIFY. A restarted
+// controller only reattaches to a disk whose superblock matches its geometry.
+typedef struct {
+    unsigned int magic;
+    unsigned long long array_id;
+    int disk_id;
+    int num_disks;
+    int num_parity;
+    int layout;
+    int group_size;
+    int block_size;
+    int disk_size;
+    int epoch;              // Epoch of the disk's latest checkpoint
+    pid_t pid;
+} superblock_t;
+
+// How the blocks of a stripe are protected
+typedef enum {
+    LAYOUT_RAID4,           // One XOR parity disk
+    LAYOUT_RS,              // Reed-Solomon with num_parity Cauchy parity disks
+    LAYOUT_LRC,             // Local XOR parity per group plus global parities
+    LAYOUT_RDP              // Row-diagonal parity, two XOR-only parity disks
+} layout_t;
+
+// Erasure code for stripes of k data units and m parity units
+typedef struct {
+    layout_t layout;
+    int k;
+    int m;
+    int group;              // Data units per local group (LRC)
+    int local;              // Number of local parity units (LRC)
+    unsigned char *matrix;  // Coefficients of the Cauchy parity units
+} code_t;
+
+// Placement of the controller and disk processes on CPUs
+typedef enum {
+    AFFINITY_NONE,          // Let the scheduler place every process
+    AFFINITY_SPREAD,        // Controller on one core, each disk on its own core
+    AFFINITY_COLOCATE       // Every disk on the controller's core
+} affinity_t;
+
+// Channels between the controller and a local disk process
+typedef enum {
+    TRANSPORT_PIPE,         // A pipe in each direction
+    TRANSPORT_SEQPACKET,    // A SOCK_SEQPACKET socketpair, one message per request
+    TRANSPORT_SPLICE        // Pipes, with the data of writes moved by vmsplice and splice
+} transport_t;
+
+// Distributions of the blocks accessed by a generated workload
+typedef enum {
+    DIST_UNIFORM,           // Every block equally likely
+    DIST_ZIPF,              // Block of popularity rank i chosen with weight 1/i^theta
+    DIST_HOTSPOT            // hot_ops_pct of accesses go to hot_pct of the blocks
+} dist_t;
+
+// A workload of random and sequential accesses, described by the first
+// group of fields and set up for drawing by init_workload
+typedef struct {
+    dist_t dist;
+    double theta;
+    int hot_pct;
+    int hot_ops_pct;
+    int seq_pct;            // Accesses that continue one of the sequential streams
+    int streams;
+    int read_pct;
+    int large_pct;          // Writes that span large_blocks aligned blocks
+    int large_blocks;
+    unsigned int seed;
+
+    int num_blocks;
+    long long stride;       // Spreads popularity ranks over the array
+    double zeta_n, zeta_2, alpha, eta;
+    int stream_next[WORKLOAD_MAX_STREAMS];
+} workload_t;
+
+// One request drawn from a workload
+typedef struct {
+    int write;
+    int block;
+    int count;
+} workload_op_t;
+
+// Costs of the array that the performance model predicts from
+typedef struct {
+    int disks;
+    int parity;
+    int block_size;
+    double disk_us;         // Latency of one access in the disk profile
+    double access_us;       // CPU time of one disk read
+    double write_access_us; // CPU time of one disk write
+    double overhead_us;     // CPU time of a request apart from its accesses
+    double encode_us;       // Time to encode one stripe
+} model_t;
+
+// Predicted performance of a workload
+typedef struct {
+    double reads_per_write; // Disk accesses of one block write
+    double writes_per_write;
+    double disk_ops;        // Disk accesses per request of the workload
+    double read_us;
+    double write_us;
+    double iops;
+    double mbps;
+} model_prediction_t;
+
+// A job for the worker pool. Jobs with the same key run in order.
+typedef struct {
+    void (*run)(void *arg);
+    void *arg;
+    long long key;
+    int next;               // Job that waits for this one, or -1
+} job_t;
+
+// Metrics written by one controller thread. Every field is a long long, so
+// that readers can add slots together as arrays.
+typedef struct {
+    long long requests[METRICS_OPS];
+    long long bytes[METRICS_OPS];
+    long long errors[METRICS_OPS];
+    long long latency_us_sum[METRICS_OPS];
+    long long latency_buckets[METRICS_OPS][METRICS_BUCKETS];
+    long long disk_requests[METRICS_MAX_DISKS][METRICS_OPS];
+    long long disk_queue[METRICS_MAX_DISKS];
+    long long disk_latency_buckets[METRICS_MAX_DISKS][METRICS_BUCKETS];
+    long long tier_hits;
+    long long tier_misses;
+    long long queue_depth;
+    long long max_queue_depth;
+} metrics_slot_t;
+
+// Geometry and state of the array, written only by the controller's main
+// thread
+typedef struct {
+    unsigned int magic;
+    pid_t pid;                      // Controller
+    int num_disks;
+    int num_parity;
+    int total_disks;                // Including the cache tier mirrors
+    int block_size;
+    int tier_blocks;
+    long long disk_failed[METRICS_MAX_DISKS];
+    long long rebuild_disk;         // Disk being rebuilt, or -1
+    long long rebuild_done;
+    long long rebuild_total;
+    long long rebuilds;
+    double start_ms;
+} metrics_state_t;
+
+// The shared metrics segment, which raidtop maps from the -S file
+typedef struct {
+    metrics_state_t state;
+    metrics_slot_t slots[METRICS_SLOTS];
+} metrics_t;
+
+// Counter values at the start of a measured region
+typedef struct {
+    unsigned long long values[PERF_EVENTS];
+    int valid;              // Cleared if the counters could not be read
+} perf_sample_t;
+
 // Command structure
 typedef struct {
     char *cmd;
     char *arg1;
     char *arg2;
+    char *arg3;
 } command_t;
 
 // These global configuration variables are defined and set in main
 extern int num_disks;
+extern int num_parity;
+extern layout_t layout;
+extern int group_size;
 extern int block_size;
 extern int disk_size;
+extern char *socket_dir;
+extern char *endpoints;
+extern char *replica_path;
+extern char *replica_listen;
+extern char *metrics_endpoint;
+extern char *stats_path;
+extern int perf_counters;
+extern int checkpoint_interval;
+extern int shutdown_timeout;
+extern int resume_checkpoints;
+extern char *disk_binary;
+extern affinity_t affinity;
+extern transport_t transport;
+extern int huge_pages;
+extern unsigned long long array_id;
+extern int tier_blocks;
+extern int disk_latency_us;
+extern int fast_latency_us;
+extern int num_workers;
+extern int quiet_output;
 
 extern int debug;
 
@@ -54,9 +337,124 @@ char *read_block(int block_num, char *data);
 int restart_disk(int disk_num);
 void simulate_disk_failure(int disk_num);
 void restore_disk_process(int disk_num);
+int rebuild_disk(int disk_num);
 void checkpoint_and_wait();
+int checkpoint_all();
+void detach_all_controllers();
+void set_affinity(affinity_t mode);
+int write_stripe(int stripe, char **blocks);
+int capacity_write(int block_num, char *data);
+char *capacity_read(int block_num, char *data);
+int access_round(int stripe, int n, char **units, int write);
+int read_tier_block(int slot, char *data);
+int write_tier_block(int slot, char *data);
+
+// Erasure coding Interface
+int init_code(code_t *code, layout_t layout, int k, int m, int group);
+void free_code(code_t *code);
+void encode_stripe(code_t *code, char **units, int len);
+int decode_stripe(code_t *code, char **units, int *present, int len);
+int repair_units(code_t *code, int target, const int *failed, int *needed);
+int repair_unit(code_t *code, char **units, const int *needed, int target, int len);
+int rdp_prime(int k, int len);
+void xor_region(char *dst, const char *src, int len);
+void gf_mul_region(char *dst, const char *src, unsigned char c, int len);
+
+// Replication Interface
+int start_replicator(const char *path);
+void replicate_write(int block_num, const char *data);
+void close_replicator_fds();
+void print_repl_stats();
+void stop_replicator();
+int serve_replica(const char *path);
+
+// Cache tier Interface
+int init_tier(int blocks);
+int tier_enabled();
+int tier_write(int block_num, char *data);
+char *tier_read(int block_num, char *data);
+void tier_idle();
+int tier_flush();
+void print_tier_stats();
+void reset_tier_stats();
+void set_tier_bypass(int bypass);
+int tier_extent_blocks(int extent);
+void set_tier_promote_all(int all);
+
+// Heat map Interface
+void heat_touch(int block_num);
+int heat_of(int block_num);
+int heat_is_hot(int block_num);
+void print_heat_map();
+
+// Metrics Interface
+int init_metrics(const char *path);
+void metrics_thread(int index);
+void metrics_request(int write, int bytes, double latency_ms, int failed);
+void metrics_disk_send(int disk_num, int write);
+void metrics_disk_reply(int disk_num);
+long long metrics_disk_total(int disk_num);
+void metrics_tier(int hit);
+void metrics_disk_failed(int disk_num, int failed);
+void metrics_rebuild(int disk_num, int done, int total);
+int start_metrics_server(const char *endpoint);
+void stop_metrics_server();
+
+// Hardware counter Interface
+int init_perf(int total_disks);
+void perf_attach_disk(int disk_num, pid_t pid);
+void perf_begin(perf_sample_t *start);
+void perf_end(int region, perf_sample_t *start, int bytes);
+void print_perf_stats();
+
+// Flight recorder Interface
+int flight_init(const char *name);
+void flight_record(int type, int disk_num, int block, int arg);
+void flight_dump(const char *reason);
+
+// Benchmark Interface
+int run_benchmark(char *kind, char *options);
+
+// Workload generator Interface
+int init_workload(workload_t *w, int num_blocks);
+void next_workload_op(workload_t *w, workload_op_t *op);
+
+// Performance model Interface
+int calibrate_model(model_t *m);
+void predict_model(const model_t *m, int read_pct, model_prediction_t *p);
+void reshape_model(model_t *m, int disks, int parity);
+
+// Worker pool Interface
+int start_workers(int count);
+void run_jobs(job_t *jobs, int n);
+void stop_workers();
+
+// Trace replay Interface
+int replay_trace(const char *path, int timed);
 
 // Disk Interface
 int start_disk(int id, int to_parent, int from_parent);
+int start_disk_listener(int id, int listen_fd);
+
+// Memory helpers
+void *alloc_region(size_t size, int huge);
+void free_region(void *p, size_t size, int huge);
+
+// IPC helpers
+double monotonic_ms();
+ssize_t read_full(int fd, void *buf, size_t n);
+ssize_t write_full(int fd, const void *buf, size_t n);
+int disk_socket_path(char *path, size_t len, int id);
+int unix_listen(const char *path);
+int unix_connect(const char *path);
+ssize_t writev_full(int fd, struct iovec *iov, int count);
+void set_nodelay(int fd);
+int tcp_listen(const char *endpoint);
+int tcp_connect(const char *endpoint);
+int open_channel(transport_t kind, int to_disk[2], int from_disk[2]);
+ssize_t read_channel(int fd, void *buf, size_t n, int packets);
+int write_requests(int fd, struct iovec *iov, int count, int packets);
+ssize_t vmsplice_full(int fd, const void *buf, size_t n);
+ssize_t splice_full(int fd, int out_fd, long long offset, size_t n);
 
 #endif // RAID_H
@@ -0,0 +1,128 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "raid.h"
+
+/*
+ * This file implements the stand-alone disk program that the controller
+ * spawns when it is given -x. The disk reads requests from standard input
+ * and writes replies to standard output, or accepts controller connections
+ * on descriptor 3 when it is given a socket directory. With -T 1 both
+ * are the disk's end of a seqpacket socketpair, and with -T 2 written
+ * blocks are spliced from standard input into a memory file.
+ *
+ * Given -e host:port, the disk instead runs as a daemon serving controllers
+ * that connect to it over TCP, which may be on another machine.
+ */
+
+// Global variables for the disk configuration, set from the command line
+int num_disks = DEFAULT_NUM_DISKS;
+int num_parity = 1;
+layout_t layout = LAYOUT_RAID4;
+int group_size = 0;
+int block_size = DEFAULT_BLOCK_SIZE;
+int disk_size = DEFAULT_DISK_SIZE;
+char *socket_dir = NULL;
+char *endpoints = NULL;
+unsigned long long array_id = 0;
+int resume_checkpoints = 0;
+int huge_pages = 0;
+int disk_latency_us = 0;
+int fast_latency_us = 0;
+transport_t transport = TRANSPORT_PIPE;
+
+/* Print usage information for the program, which has name prog_name.
+ */
+static void print_usage(char *prog_name) {
+    fprintf(stderr, "Usage: %s -i disk_id [-n num_disks] [-m num_parity] [-l layout] [-g group_size] [-b block_size] [-d disk_size] [-a array_id] [-r] [-H] [-D us] [-F us] [-T transport] [-s socket_dir | -e host:port]\n", prog_name);
+    exit(1);
+}
+
+/* The main entry point for a spawned disk process.
+ */
+int main(int argc, char **argv) {
+    int id = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:m:l:g:b:d:a:rHD:F:T:s:e:h")) != -1) {
+        switch (opt) {
+            case 'i':
+                id = atoi(optarg);
+                break;
+            case 'n':
+                num_disks = atoi(optarg);
+                break;
+            case 'm':
+                num_parity = atoi(optarg);
+                break;
+            case 'l':
+                layout = atoi(optarg);
+                break;
+            case 'g':
+                group_size = atoi(optarg);
+                break;
+            case 'b':
+                block_size = atoi(optarg);
+                break;
+            case 'd':
+                disk_size = atoi(optarg);
+                break;
+            case 'a':
+                array_id = strtoull(optarg, NULL, 16);
+                break;
+            case 'r':
+                resume_checkpoints = 1;
+                break;
+            case 'H':
+                huge_pages = 1;
+                break;
+            case 'D':
+                disk_latency_us = atoi(optarg);
+                break;
+            case 'F':
+                fast_latency_us = atoi(optarg);
+                break;
+            case 'T':
+                transport = atoi(optarg);
+                break;
+            case 's':
+                socket_dir = optarg;
+                break;
+            case 'e':
+                endpoints = optarg;
+                break;
+            case 'h':
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if (id < 0 || num_disks <= 0 || block_size <= 0 || disk_size <= 0) {
+        print_usage(argv[0]);
+    }
+
+    if (endpoints != NULL) {
+        int listen_fd = tcp_listen(endpoints);
+        if (listen_fd == -1) {
+            return 1;
+        }
+        return start_disk_listener(id, listen_fd);
+    }
+    if (socket_dir != NULL) {
+        return start_disk_listener(id, 3);
+    }
+    return start_disk(id, STDOUT_FILENO, STDIN_FILENO);
+}
@@ -15,6 +15,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "raid.h"
 
 /*
@@ -26,47 +33,117 @@
  * controller functions that implement these commands. 
  */
 
- // Maximum length of a buffer to hold a RAID command
-#define MAX_CMD_LENGTH 256
+ // Maximum number of files that wbf keeps mapped
+#define MAX_MAPPED_FILES 16
+
+// Size of the stdout buffer in quiet mode (-q), which holds many blocks
+#define OUTPUT_BUFFER_SIZE (1 << 20)
 
 // Global variables for RAID configuration
 int num_disks = DEFAULT_NUM_DISKS;
+int num_parity = 1;
+layout_t layout = LAYOUT_RAID4;
+int group_size = 0;
 int block_size = DEFAULT_BLOCK_SIZE;
 int disk_size = DEFAULT_DISK_SIZE;
+char *socket_dir = NULL;
+char *endpoints = NULL;
+char *replica_path = NULL;
+char *replica_listen = NULL;
+char *metrics_endpoint = NULL;
+char *stats_path = NULL;
+int perf_counters = 0;
+int checkpoint_interval = 0;
+int shutdown_timeout = DEFAULT_SHUTDOWN_TIMEOUT;
+int resume_checkpoints = 0;
+char *disk_binary = NULL;
+affinity_t affinity = AFFINITY_NONE;
+transport_t transport = TRANSPORT_PIPE;
+int huge_pages = 0;
+unsigned long long array_id = 0;
+int tier_blocks = 0;
+int disk_latency_us = 0;
+int fast_latency_us = 0;
+int num_workers = 0;
+int quiet_output = 0;
 
 /* Print usage information for the program, which has name prog_name.
  */
 static void print_usage(char *prog_name) {
-    fprintf(stderr, "Usage: %s [-n num_disks] [-b block_size] [-d disk_size] [-t file_name]\n", prog_name);
+    fprintf(stderr, "Usage: %s [-n num_disks] [-l layout] [-m num_parity] [-g group_size] [-b block_size] [-d disk_size] [-t file_name] [-s socket_dir] [-e endpoints] [-P socket | -L socket] [-M endpoint] [-S stats_file] [-p] [-c seconds] [-w seconds] [-r] [-x disk_binary] [-a spread|colocate] [-H] [-f tier_blocks] [-D us] [-F us] [-j workers] [-q] [-T pipe|seqpacket|splice]\n", prog_name);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  -n num_disks   Number of data disks (default: %d)\n", DEFAULT_NUM_DISKS);
+    fprintf(stderr, "  -l layout      Stripe layout: raid4, rs (Reed-Solomon), lrc (locally repairable) or rdp (row-diagonal parity) (default: raid4)\n");
+    fprintf(stderr, "  -m num_parity  Number of parity disks for rs, or of global parity disks for lrc (default: 2)\n");
+    fprintf(stderr, "  -g group_size  Number of data disks in each local group of the lrc layout (default: half)\n");
     fprintf(stderr, "  -b block_size  Size of each block in bytes (default: %d)\n", DEFAULT_BLOCK_SIZE);
     fprintf(stderr, "  -d disk_size   Size of each disk in bytes (default: %d)\n", DEFAULT_DISK_SIZE);
     fprintf(stderr, "  -t file_name   Use the transaction file named file_name instead of stdin for input\n");
+    fprintf(stderr, "  -s socket_dir  Run disks on named sockets in socket_dir and reattach to running disks\n");
+    fprintf(stderr, "  -e endpoints   Use raid_disk daemons at the comma separated host:port list, one per disk\n");
+    fprintf(stderr, "  -P socket      Replicate writes asynchronously to the secondary listening on socket\n");
+    fprintf(stderr, "  -L socket      Act as a secondary: apply the writes of a primary connecting to socket\n");
+    fprintf(stderr, "  -M endpoint    Serve Prometheus metrics over HTTP on a Unix socket path or a host:port\n");
+    fprintf(stderr, "  -S stats_file  Keep the metrics in stats_file, for raidtop to display\n");
+    fprintf(stderr, "  -p             Count cycles, instructions, cache and branch misses of each operation\n");
+    fprintf(stderr, "  -c seconds     Checkpoint all disks in the background every seconds seconds\n");
+    fprintf(stderr, "  -w seconds     Kill disks that take longer than seconds to shut down, 0 to wait forever (default: %d)\n", DEFAULT_SHUTDOWN_TIMEOUT);
+    fprintf(stderr, "  -r             Resume each disk from its checkpoint file if there is one\n");
+    fprintf(stderr, "  -x disk_binary Start disks by spawning disk_binary (e.g. ./raid_disk) instead of forking\n");
+    fprintf(stderr, "  -a placement   Pin each disk to its own core (spread) or to the controller's core (colocate)\n");
+    fprintf(stderr, "  -H             Back disk images and controller buffers with huge pages\n");
+    fprintf(stderr, "  -f tier_blocks Put a RAID 1 cache tier of tier_blocks blocks in front of the array\n");
+    fprintf(stderr, "  -D us          Add us microseconds of latency to every access to a capacity disk\n");
+    fprintf(stderr, "  -F us          Add us microseconds of latency to every access to a cache tier disk\n");
+    fprintf(stderr, "  -j workers     Run independent wb and rb commands of the transaction file on workers threads\n");
+    fprintf(stderr, "  -T transport   Reach local disks over pipes (pipe), SOCK_SEQPACKET socketpairs (seqpacket) or pipes that move written blocks with vmsplice and splice (splice) (default: pipe)\n");
+    fprintf(stderr, "  -q             Quiet: no message per block, and output is written in large batches\n");
     exit(1);
 }
 
 /* Print the preamble when the shell interface is used
 */
 static void print_command_shell_header() {
-    printf("RAID 4 Simulator Shell\n");
+    if (layout == LAYOUT_RS) {
+        printf("Reed-Solomon %d+%d Simulator Shell\n", num_disks, num_parity);
+    } else if (layout == LAYOUT_LRC) {
+        printf("LRC %d+%d (groups of %d) Simulator Shell\n", num_disks, num_parity, group_size);
+    } else if (layout == LAYOUT_RDP) {
+        printf("RAID-DP %d+2 Simulator Shell\n", num_disks);
+    } else {
+        printf("RAID 4 Simulator Shell\n");
+    }
     printf("System configuration:\n");
     printf("  Number of data disks: %d\n", num_disks);
+    printf("  Number of parity disks: %d\n", num_parity);
     printf("  Block size: %d bytes\n", block_size);
     printf("  Disk size: %d bytes\n", disk_size);
+    if (tier_blocks > 0) {
+        printf("  Cache tier: %d blocks on %d mirrored disks\n", tier_blocks, TIER_DISKS);
+    }
 
     printf("Available commands:\n");
     printf("  wb <block_num> <file from local> \n");
+    printf("  wbx <block_num> <hex or base64 data> \n");
+    printf("  wbf <block_num> <file from local> <offset> \n");
     printf("  rb <block_num> \n");
     printf("  kill <disk_num> \n");
+    printf("  rebuild <disk_num> \n");
+    printf("  checkpoint \n");
+    printf("  stats <repl|tier|heat|perf> \n");
+    printf("  bench <rw|affinity|hugepage|codes|repair|rebuild|tier|workload|model|ipc> [key=value,...] \n");
+    printf("  replay <trace file> [timed] \n");
+    if (socket_dir != NULL || endpoints != NULL) {
+        printf("  detach \n");
+    }
     printf("  exit \n");
 }
 
-/* Print the block block_num from the RAID system to stdout.
+/* Print the block block_num from the RAID system to out.
  *
  * Returns 0 on success and -1 on error.
  */
-static int print_block(int block_num) {
+static int print_block(FILE *out, int block_num) {
     char *block = malloc(block_size);
     if (!block) {
         perror("Failed to allocate memory for block");
@@ -79,13 +156,15 @@ static int print_block(int block_num) {
         return -1;
     }
 
-    if (fwrite(block, 1, block_size, stdout) != (size_t)block_size) {
+    if (fwrite(block, 1, block_size, out) != (size_t)block_size) {
         fprintf(stderr, "Failed to write block to stdout");
         free(block);
         return -1;
     }
 
-    fprintf(stderr, "Block %d printed\n", block_num);
+    if (!quiet_output) {
+        fprintf(stderr, "Block %d printed\n", block_num);
+    }
     free(block);
     return 0;
 }
@@ -105,6 +184,7 @@ command_t *parse_command(char *line) {
     }
     cmd->arg1 = NULL;
     cmd->arg2 = NULL;
+    cmd->arg3 = NULL;
 
     cmd->cmd = strtok(line, " ");
     if (!cmd->cmd) {
@@ -113,6 +193,7 @@ command_t *parse_command(char *line) {
     }
     cmd->arg1 = strtok(NULL, " ");
     cmd->arg2 = strtok(NULL, " ");
+    cmd->arg3 = strtok(NULL, " ");
 
     return cmd;
 }
@@ -154,7 +235,261 @@ static int copy_block_to_raid(int block_num, char *filename) {
     }
 
     fclose(fp);
-    fprintf(stderr, "Block %d written to RAID\n", block_num);
+    if (!quiet_output) {
+        fprintf(stderr, "Block %d written to RAID\n", block_num);
+    }
+    return 0;
+}
+
+/* Return the value of the hex digit c, or -1 if it is not one.
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Return the value of the base64 digit c, or -1 if it is not one.
+ */
+static int base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    return c == '+' ? 62 : c == '/' ? 63 : -1;
+}
+
+/* Decode the hex text into out, which holds size bytes.
+ *
+ * Returns the number of bytes decoded, or -1 if text is not hex or is
+ * longer than size bytes.
+ */
+static int decode_hex(const char *text, char *out, int size) {
+    size_t len = strlen(text);
+    if (len % 2 != 0 || len / 2 > (size_t)size) {
+        return -1;
+    }
+    for (size_t i = 0; i < len / 2; i++) {
+        int high = hex_value(text[2 * i]);
+        int low = hex_value(text[2 * i + 1]);
+        if (high == -1 || low == -1) {
+            return -1;
+        }
+        out[i] = (char)(high << 4 | low);
+    }
+    return len / 2;
+}
+
+/* Decode the base64 text, padded with '=' or not, into out, which holds
+ * size bytes.
+ *
+ * Returns the number of bytes decoded, or -1 if text is not base64 or is
+ * longer than size bytes.
+ */
+static int decode_base64(const char *text, char *out, int size) {
+    size_t len = strlen(text);
+    for (int pad = 0; pad < 2 && len > 0 && text[len - 1] == '='; pad++) {
+        len--;
+    }
+    int n = 0, bits = 0;
+    unsigned int acc = 0;
+    for (size_t i = 0; i < len; i++) {
+        int value = base64_value(text[i]);
+        if (value == -1) {
+            return -1;
+        }
+        acc = (acc << 6 | value) & 0xffff;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == size) {
+                return -1;
+            }
+            out[n++] = (char)(acc >> bits);
+        }
+    }
+    return n;
+}
+
+/* Write the block given by payload, block_size bytes in hex or base64, to
+ * the RAID system at block block_num. A payload of twice block_size hex
+ * digits is read as hex, anything else as base64.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static int copy_payload_to_raid(int block_num, const char *payload) {
+    char buffer[block_size];
+    int n = -1;
+    if (strlen(payload) == 2 * (size_t)block_size) {
+        n = decode_hex(payload, buffer, block_size);
+    }
+    if (n == -1) {
+        n = decode_base64(payload, buffer, block_size);
+    }
+    if (n != block_size) {
+        fprintf(stderr, "Error: Data is not %d bytes of hex or base64\n", block_size);
+        return -1;
+    }
+
+    if (write_block(block_num, buffer) != 0) {
+        fprintf(stderr, "Failed to write block to RAID");
+        return -1;
+    }
+    if (!quiet_output) {
+        fprintf(stderr, "Block %d written to RAID\n", block_num);
+    }
+    return 0;
+}
+
+// Files read by wbf, kept open and mapped until the program exits so that a
+// transaction file can take many blocks from one file without reopening it
+typedef struct {
+    char *path;
+    char *data;
+    size_t size;
+} mapped_file_t;
+
+static mapped_file_t mapped_files[MAX_MAPPED_FILES];
+static int num_mapped_files;
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return the mapping of the file named filename, mapping it the first time
+ * it is used.
+ *
+ * Returns NULL if the file cannot be mapped or too many files are mapped.
+ */
+static mapped_file_t *map_file(const char *filename) {
+    pthread_mutex_lock(&mapped_lock);
+    for (int i = 0; i < num_mapped_files; i++) {
+        if (strcmp(mapped_files[i].path, filename) == 0) {
+            pthread_mutex_unlock(&mapped_lock);
+            return &mapped_files[i];
+        }
+    }
+    if (num_mapped_files == MAX_MAPPED_FILES) {
+        fprintf(stderr, "Error: wbf can read from at most %d files\n", MAX_MAPPED_FILES);
+        pthread_mutex_unlock(&mapped_lock);
+        return NULL;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        char msg[MAX_PATH];
+        snprintf(msg, sizeof(msg), "Error opening %s", filename);
+        perror(msg);
+        if (fd != -1) {
+            close(fd);
+        }
+        pthread_mutex_unlock(&mapped_lock);
+        return NULL;
+    }
+    mapped_file_t *m = &mapped_files[num_mapped_files];
+    m->size = st.st_size;
+    m->data = NULL;
+    if (m->size > 0) {
+        m->data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m->data == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            pthread_mutex_unlock(&mapped_lock);
+            return NULL;
+        }
+    }
+    close(fd);
+    m->path = strdup(filename);
+    if (m->path == NULL) {
+        perror("strdup");
+        if (m->data != NULL) {
+            munmap(m->data, m->size);
+        }
+        pthread_mutex_unlock(&mapped_lock);
+        return NULL;
+    }
+    num_mapped_files++;
+    pthread_mutex_unlock(&mapped_lock);
+    return m;
+}
+
+/* Copy the block_size bytes at offset in the local file named filename to
+ * the RAID system at block block_num.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static int copy_range_to_raid(int block_num, const char *filename, long long offset) {
+    mapped_file_t *m = map_file(filename);
+    if (m == NULL) {
+        return -1;
+    }
+    if (offset < 0 || (size_t)offset + block_size > m->size) {
+        fprintf(stderr, "Error: %s has no full block at offset %lld\n", filename, offset);
+        return -1;
+    }
+    if (write_block(block_num, m->data + offset) != 0) {
+        fprintf(stderr, "Failed to write block to RAID");
+        return -1;
+    }
+    if (!quiet_output) {
+        fprintf(stderr, "Block %d written to RAID\n", block_num);
+    }
+    return 0;
+}
+
+/* Return 1 if cmd is a wb, wbx, wbf or rb command, which touches a single
+ * block, and 0 otherwise.
+ */
+static int is_block_command(command_t *cmd) {
+    return strcmp(cmd->cmd, "wb") == 0 || strcmp(cmd->cmd, "wbx") == 0 || strcmp(cmd->cmd, "wbf") == 0
+        || strcmp(cmd->cmd, "rb") == 0;
+}
+
+/* Execute the wb, wbx, wbf or rb command cmd, printing its output to out.
+ *
+ * Returns 0 on success and -1 on error.
+ */
+static int run_block_command(command_t *cmd, FILE *out) {
+    if (strcmp(cmd->cmd, "wb") == 0) {
+        if (cmd->arg2 == NULL || cmd->arg1 == NULL) {
+            fprintf(out, "Usage: wb <block_num> <file from local>\n");
+            return -1;
+        }
+        fprintf(out, "wb\n");
+        copy_block_to_raid(atoi(cmd->arg1), cmd->arg2);
+        return 0;
+    }
+    if (strcmp(cmd->cmd, "wbx") == 0) {
+        if (cmd->arg2 == NULL || cmd->arg1 == NULL) {
+            fprintf(out, "Usage: wbx <block_num> <hex or base64 data>\n");
+            return -1;
+        }
+        fprintf(out, "wbx\n");
+        return copy_payload_to_raid(atoi(cmd->arg1), cmd->arg2);
+    }
+    if (strcmp(cmd->cmd, "wbf") == 0) {
+        if (cmd->arg3 == NULL || cmd->arg2 == NULL || cmd->arg1 == NULL) {
+            fprintf(out, "Usage: wbf <block_num> <file from local> <offset>\n");
+            return -1;
+        }
+        fprintf(out, "wbf\n");
+        return copy_range_to_raid(atoi(cmd->arg1), cmd->arg2, atoll(cmd->arg3));
+    }
+    if (cmd->arg1 == NULL) {
+        fprintf(out, "Usage: rb <block_num>\n");
+        return -1;
+    }
+    print_block(out, atoi(cmd->arg1));
     return 0;
 }
 
@@ -163,8 +498,16 @@ static int copy_block_to_raid(int block_num, char *filename) {
  * This function implements the RAID shell commands:
  * - exit: Exit the program
  * - wb: Write a block from a local file to the RAID system
+ * - wbx: Write a block given in hex or base64 on the command line
+ * - wbf: Write a block from an offset in a local file
  * - rb: Read a block from the RAID system to stdout
  * - kill: Kills one of the disk processes
+ * - rebuild: Rebuilds a failed disk onto a new disk process
+ * - bench: Run one of the benchmarks against the array
+ * - replay: Replay a fio iolog or blkparse trace against the array
+ * - checkpoint: Take a consistent background checkpoint of all disks
+ * - stats: Print the figures of one part of the system
+ * - detach: Exit the program, leaving socket disks running for reattach
  *
  * Returns 0 on success and -1 on error.
  */
@@ -174,32 +517,65 @@ int execute_command(command_t *cmd) {
     }
 
     if (strcmp(cmd->cmd, "exit") == 0) {
+        tier_flush();
+        stop_replicator();
+        stop_metrics_server();
         checkpoint_and_wait();
         exit(0);
     }
-    else if (strcmp(cmd->cmd, "wb") == 0) {
-        if (cmd->arg2 == NULL || cmd->arg1 == NULL) {
-            printf("Usage: wb <block_num> <file from local>\n");
+    else if (is_block_command(cmd)) {
+        return run_block_command(cmd, stdout);
+    } else if (strcmp(cmd->cmd, "kill") == 0) {
+        if (cmd->arg1 == NULL) {
+            printf("Usage: kill <disk_num>\n");
             return -1;
         }
-        printf("wb\n");
-        copy_block_to_raid(atoi(cmd->arg1), cmd->arg2);
+        simulate_disk_failure(atoi(cmd->arg1));
         return 0;
-    }
-    else if (strcmp(cmd->cmd, "rb") == 0) {
+    } else if (strcmp(cmd->cmd, "rebuild") == 0) {
         if (cmd->arg1 == NULL) {
-            printf("Usage: rb <block_num>\n");
+            printf("Usage: rebuild <disk_num>\n");
             return -1;
         }
-        print_block(atoi(cmd->arg1));
-        return 0;
-    } else if (strcmp(cmd->cmd, "kill") == 0) {
+        return rebuild_disk(atoi(cmd->arg1));
+    } else if (strcmp(cmd->cmd, "bench") == 0) {
         if (cmd->arg1 == NULL) {
-            printf("Usage: kill <disk_num>\n");
+            printf("Usage: bench <rw|affinity|hugepage|codes|repair|rebuild|tier|workload|model|ipc> [key=value,...]\n");
+            return -1;
+        }
+        return run_benchmark(cmd->arg1, cmd->arg2);
+    } else if (strcmp(cmd->cmd, "replay") == 0) {
+        if (cmd->arg1 == NULL || (cmd->arg2 != NULL && strcmp(cmd->arg2, "timed") != 0)) {
+            printf("Usage: replay <trace file> [timed]\n");
+            return -1;
+        }
+        return replay_trace(cmd->arg1, cmd->arg2 != NULL);
+    } else if (strcmp(cmd->cmd, "checkpoint") == 0) {
+        return checkpoint_all();
+    } else if (strcmp(cmd->cmd, "stats") == 0) {
+        if (cmd->arg1 != NULL && strcmp(cmd->arg1, "repl") == 0) {
+            print_repl_stats();
+        } else if (cmd->arg1 != NULL && strcmp(cmd->arg1, "tier") == 0) {
+            print_tier_stats();
+        } else if (cmd->arg1 != NULL && strcmp(cmd->arg1, "heat") == 0) {
+            print_heat_map();
+        } else if (cmd->arg1 != NULL && strcmp(cmd->arg1, "perf") == 0) {
+            print_perf_stats();
+        } else {
+            printf("Usage: stats <repl|tier|heat|perf>\n");
             return -1;
         }
-        simulate_disk_failure(atoi(cmd->arg1));
         return 0;
+    } else if (strcmp(cmd->cmd, "detach") == 0) {
+        if (socket_dir == NULL && endpoints == NULL) {
+            printf("detach requires disks started with -s or -e\n");
+            return -1;
+        }
+        tier_flush();
+        stop_replicator();
+        stop_metrics_server();
+        detach_all_controllers();
+        exit(0);
     } else {
         printf("Unknown command: %s\n", cmd->cmd);
         return -1;
@@ -214,6 +590,107 @@ static void cleanup_command(command_t *cmd) {
     }
 }
 
+// A block command of the transaction file waiting for the workers (-j).
+// What it prints is kept until every command before it has printed.
+typedef struct {
+    char *line;             // The text that cmd points into
+    command_t *cmd;
+    FILE *out;
+    char *output;
+    size_t output_len;
+    int status;
+} pending_t;
+
+static pending_t pending[WORKER_BATCH];
+static job_t jobs[WORKER_BATCH];
+static int num_pending;
+
+/* Run the pending command arg on a worker.
+ */
+static void run_pending(void *arg) {
+    pending_t *p = arg;
+    p->status = run_block_command(p->cmd, p->out);
+}
+
+/* Run the pending commands on the workers, then print their output in the
+ * order of the transaction file.
+ */
+static void run_pending_commands() {
+    run_jobs(jobs, num_pending);
+    for (int i = 0; i < num_pending; i++) {
+        pending_t *p = &pending[i];
+        fclose(p->out);
+        fwrite(p->output, 1, p->output_len, stdout);
+        free(p->output);
+        if (p->status == -1) {
+            fprintf(stderr, "Command execution failed\n");
+        }
+        cleanup_command(p->cmd);
+        free(p->line);
+    }
+    if (!quiet_output) {
+        fflush(stdout);
+    }
+    num_pending = 0;
+}
+
+/* Queue the block command cmd, parsed from line, to run on the workers
+ * after the earlier commands on the same stripe, running the queue once it
+ * is full. The queue takes over cmd and line.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int queue_command(command_t *cmd, char *line) {
+    pending_t *p = &pending[num_pending];
+    p->line = line;
+    p->cmd = cmd;
+    p->out = open_memstream(&p->output, &p->output_len);
+    if (p->out == NULL) {
+        perror("open_memstream");
+        cleanup_command(cmd);
+        free(line);
+        return -1;
+    }
+    job_t *job = &jobs[num_pending++];
+    job->run = run_pending;
+    job->arg = p;
+    job->key = p->cmd->arg1 != NULL ? atoi(p->cmd->arg1) / num_disks : -1;
+    if (num_pending == WORKER_BATCH) {
+        run_pending_commands();
+    }
+    return 0;
+}
+
+/* Checkpoint every disk once checkpoint_interval seconds have passed since
+ * *last, after running any queued commands so the checkpoint holds them.
+ */
+static void periodic_checkpoint(time_t *last) {
+    if (checkpoint_interval <= 0 || time(NULL) - *last < checkpoint_interval) {
+        return;
+    }
+    if (num_pending > 0) {
+        run_pending_commands();
+    }
+    if (checkpoint_all() == -1) {
+        fprintf(stderr, "Periodic checkpoint failed\n");
+    }
+    *last = time(NULL);
+}
+
+/* Wait until fd has input or the periodic checkpoint after last is due.
+ *
+ * Returns 1 if fd has input and 0 if the checkpoint is due first.
+ */
+static int wait_for_input(int fd, time_t last) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    long left = (long)(last + checkpoint_interval - time(NULL)) * 1000;
+    int ready = poll(&pfd, 1, left > 0 ? (int)left : 0);
+    if (ready == -1 && errno != EINTR) {
+        // Let the read report the error
+        return 1;
+    }
+    return ready > 0;
+}
 
 /* The main entry point for the RAID simulation program.
  */
@@ -223,7 +700,8 @@ int main(int argc, char **argv) {
 
     // Parse command line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "n:b:d:t:h")) != -1) {
+    int parity_arg = 0;
+    while ((opt = getopt(argc, argv, "n:l:m:g:b:d:t:s:e:P:L:M:S:pc:w:rx:a:Hf:D:F:j:qT:h")) != -1) {
         switch (opt) {
             case 'n':
                 num_disks = atoi(optarg);
@@ -232,6 +710,34 @@ int main(int argc, char **argv) {
                     print_usage(argv[0]);
                 }
                 break;
+            case 'l':
+                if (strcmp(optarg, "raid4") == 0) {
+                    layout = LAYOUT_RAID4;
+                } else if (strcmp(optarg, "rs") == 0) {
+                    layout = LAYOUT_RS;
+                } else if (strcmp(optarg, "lrc") == 0) {
+                    layout = LAYOUT_LRC;
+                } else if (strcmp(optarg, "rdp") == 0) {
+                    layout = LAYOUT_RDP;
+                } else {
+                    fprintf(stderr, "Error: Layout must be raid4, rs, lrc or rdp\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'm':
+                parity_arg = atoi(optarg);
+                if (parity_arg <= 0) {
+                    fprintf(stderr, "Error: Number of parity disks must be positive\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'g':
+                group_size = atoi(optarg);
+                if (group_size <= 0) {
+                    fprintf(stderr, "Error: Group size must be positive\n");
+                    print_usage(argv[0]);
+                }
+                break;
             case 'b':
                 block_size = atoi(optarg);
                 if (block_size <= 0) {
@@ -253,29 +759,254 @@ int main(int argc, char **argv) {
                     print_usage(argv[0]);
                 }
                 break;
+            case 's':
+                socket_dir = optarg;
+                break;
+            case 'e':
+                endpoints = optarg;
+                break;
+            case 'P':
+                replica_path = optarg;
+                break;
+            case 'L':
+                replica_listen = optarg;
+                break;
+            case 'M':
+                metrics_endpoint = optarg;
+                break;
+            case 'S':
+                stats_path = optarg;
+                break;
+            case 'p':
+                perf_counters = 1;
+                break;
+            case 'c':
+                checkpoint_interval = atoi(optarg);
+                if (checkpoint_interval <= 0) {
+                    fprintf(stderr, "Error: Checkpoint interval must be positive\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'w':
+                shutdown_timeout = atoi(optarg);
+                if (shutdown_timeout < 0) {
+                    fprintf(stderr, "Error: Shutdown timeout must not be negative\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'r':
+                resume_checkpoints = 1;
+                break;
+            case 'x':
+                disk_binary = optarg;
+                break;
+            case 'a':
+                if (strcmp(optarg, "spread") == 0) {
+                    affinity = AFFINITY_SPREAD;
+                } else if (strcmp(optarg, "colocate") == 0) {
+                    affinity = AFFINITY_COLOCATE;
+                } else {
+                    fprintf(stderr, "Error: Placement must be spread or colocate\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'H':
+                huge_pages = 1;
+                break;
+            case 'f':
+                tier_blocks = atoi(optarg);
+                if (tier_blocks <= 0) {
+                    fprintf(stderr, "Error: Cache tier size must be positive\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'D':
+                disk_latency_us = atoi(optarg);
+                if (disk_latency_us < 0) {
+                    fprintf(stderr, "Error: Disk latency must not be negative\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'F':
+                fast_latency_us = atoi(optarg);
+                if (fast_latency_us < 0) {
+                    fprintf(stderr, "Error: Disk latency must not be negative\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'j':
+                num_workers = atoi(optarg);
+                if (num_workers <= 0 || num_workers > MAX_WORKERS) {
+                    fprintf(stderr, "Error: Number of workers must be between 1 and %d\n", MAX_WORKERS);
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'q':
+                quiet_output = 1;
+                break;
+            case 'T':
+                if (strcmp(optarg, "pipe") == 0) {
+                    transport = TRANSPORT_PIPE;
+                } else if (strcmp(optarg, "seqpacket") == 0) {
+                    transport = TRANSPORT_SEQPACKET;
+                } else if (strcmp(optarg, "splice") == 0) {
+                    transport = TRANSPORT_SPLICE;
+                } else {
+                    fprintf(stderr, "Error: Transport must be pipe, seqpacket or splice\n");
+                    print_usage(argv[0]);
+                }
+                break;
             case 'h':
             default:
                 print_usage(argv[0]);
         }
     }
 
-    // Initialize disk processes and parity disk process
-    if (init_all_controllers(num_disks + 1) == -1) {
+    if (layout == LAYOUT_RS) {
+        num_parity = parity_arg > 0 ? parity_arg : 2;
+    } else if (layout == LAYOUT_LRC) {
+        // One local parity per group of data disks, then the global parities
+        if (group_size == 0) {
+            group_size = (num_disks + 1) / 2;
+        }
+        if (group_size > num_disks) {
+            fprintf(stderr, "Error: Group size must not exceed the number of data disks\n");
+            print_usage(argv[0]);
+        }
+        num_parity = (num_disks + group_size - 1) / group_size + (parity_arg > 0 ? parity_arg : 2);
+    } else if (layout == LAYOUT_RDP) {
+        if (parity_arg > 0 && parity_arg != 2) {
+            fprintf(stderr, "Error: RDP has exactly two parity disks\n");
+            print_usage(argv[0]);
+        }
+        num_parity = 2;
+        if (rdp_prime(num_disks, block_size) == -1) {
+            fprintf(stderr, "Error: RDP needs a block size that splits into p - 1 rows for a prime p > %d\n", num_disks);
+            print_usage(argv[0]);
+        }
+    } else if (parity_arg > 1) {
+        fprintf(stderr, "Error: RAID 4 has exactly one parity disk\n");
+        print_usage(argv[0]);
+    }
+
+    if (socket_dir != NULL && endpoints != NULL) {
+        fprintf(stderr, "Error: -s and -e cannot be used together\n");
+        print_usage(argv[0]);
+    }
+
+    // The other transports only join the controller to disks it starts. A
+    // seqpacket message must fit in the socket's send buffer, and spliced
+    // blocks are whole pages of an image that is not on huge pages.
+    if (transport != TRANSPORT_PIPE && (socket_dir != NULL || endpoints != NULL)) {
+        fprintf(stderr, "Error: -T seqpacket and -T splice cannot be used with -s or -e\n");
+        print_usage(argv[0]);
+    }
+    if (transport == TRANSPORT_SEQPACKET && block_size > SEQPACKET_MAX_BLOCK) {
+        fprintf(stderr, "Error: Block size must not exceed %d with -T seqpacket\n", SEQPACKET_MAX_BLOCK);
+        print_usage(argv[0]);
+    }
+    if (transport == TRANSPORT_SPLICE && (block_size % sysconf(_SC_PAGESIZE) != 0 || huge_pages)) {
+        fprintf(stderr, "Error: -T splice needs a block size that is a multiple of %ld and no -H\n", sysconf(_SC_PAGESIZE));
+        print_usage(argv[0]);
+    }
+
+    // The cache tier, the replicator and the performance counters keep
+    // their state for a single thread
+    if (num_workers > 0 && (tier_blocks > 0 || replica_path != NULL || perf_counters)) {
+        fprintf(stderr, "Error: -j cannot be used with -f, -P or -p\n");
+        print_usage(argv[0]);
+    }
+
+    // In quiet mode the output of many commands goes out in one write. A
+    // forked child would write whatever is buffered again when it exits, so
+    // stdout is flushed before every fork.
+    if (quiet_output && setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE) != 0) {
+        fprintf(stderr, "Error: Cannot buffer the output\n");
+        return -1;
+    }
+
+    // Every process keeps a flight recorder; forked processes start their own
+    if (flight_init("raid_sim") == -1) {
+        return -1;
+    }
+
+    // The metrics segment is shared with every process forked after it, and
+    // the helper processes are started before the disks so that they do not
+    // hold the disks' channels open
+    if (init_metrics(stats_path) == -1) {
+        return -1;
+    }
+    if (metrics_endpoint != NULL && start_metrics_server(metrics_endpoint) == -1) {
+        return -1;
+    }
+    if (replica_path != NULL && start_replicator(replica_path) == -1) {
+        return -1;
+    }
+
+    // Initialize disk processes and parity disk processes, followed by the
+    // mirrors of the cache tier
+    if (tier_blocks > 0 && init_tier(tier_blocks) == -1) {
+        return -1;
+    }
+    int total_disks = num_disks + num_parity + (tier_blocks > 0 ? TIER_DISKS : 0);
+    if (perf_counters && init_perf(total_disks) == -1) {
+        return -1;
+    }
+    if (init_all_controllers(total_disks) == -1) {
         fprintf(stderr, "Failed to initialize disk processes\n");
         return -1;
     }
+    if (replica_listen != NULL && serve_replica(replica_listen) == -1) {
+        fprintf(stderr, "Replication from the primary failed\n");
+    }
+    if (affinity != AFFINITY_NONE) {
+        set_affinity(affinity);
+    }
+
+    // Commands only run in parallel from a transaction file, where nobody
+    // waits on the output of each command before typing the next
+    int parallel = num_workers > 0 && tf != stdin;
+    if (parallel && start_workers(num_workers) == -1) {
+        return -1;
+    }
 
     if (tf == stdin) {
         print_command_shell_header();
     }
 
+    // Periodic checkpoints are taken between commands, so they never
+    // interleave with the requests of a single command.
+    time_t last_checkpoint = time(NULL);
+
+    // Input that can block, such as a terminal or a pipe, is polled so an
+    // idle controller still checkpoints. The stream is unbuffered so that
+    // no line can wait in the stdio buffer while poll sees an empty fd.
+    struct stat tf_stat;
+    int idle_checkpoints = checkpoint_interval > 0
+            && fstat(fileno(tf), &tf_stat) == 0 && !S_ISREG(tf_stat.st_mode);
+    if (idle_checkpoints) {
+        setvbuf(tf, NULL, _IONBF, 0);
+    }
+
+    // Lines have no length limit, since wbx carries a whole block
+    char *line = NULL;
+    size_t line_size = 0;
     while (1) {
+        // Checked before every line, so a run of queued block commands
+        // still gets its checkpoints
+        periodic_checkpoint(&last_checkpoint);
+
         if(tf == stdin) {
             printf("raid> ");
+            if (quiet_output) {
+                fflush(stdout);
+            }
         }
 
-        char line[MAX_CMD_LENGTH];
-        if (!fgets(line, sizeof(line), tf)) {
+        while (idle_checkpoints && !wait_for_input(fileno(tf), last_checkpoint)) {
+            periodic_checkpoint(&last_checkpoint);
+        }
+        if (getline(&line, &line_size, tf) == -1) {
             if(!feof(tf)) {
                 fprintf(stderr, "Error reading command");
             }
@@ -293,11 +1024,36 @@ int main(int argc, char **argv) {
             fprintf(stderr, "Failed to parse command\n");
             continue;
         }
+
+        // Block commands are queued for the workers; any other command is a
+        // barrier that runs once every command before it is done
+        if (parallel && is_block_command(cmd)) {
+            if (queue_command(cmd, line) == -1) {
+                fprintf(stderr, "Command execution failed\n");
+            }
+            line = NULL;
+            line_size = 0;
+            continue;
+        }
+        if (num_pending > 0) {
+            run_pending_commands();
+        }
         if (execute_command(cmd) == -1) {
             fprintf(stderr, "Command execution failed\n");
         }
         cleanup_command(cmd);
+        tier_idle();
+    }
+    free(line);
+    if (num_pending > 0) {
+        run_pending_commands();
+    }
+    if (parallel) {
+        stop_workers();
     }
+    tier_flush();
+    stop_replicator();
+    stop_metrics_server();
     checkpoint_and_wait();
     return 0;
 }
@@ -0,0 +1,221 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "raid.h"
+
+/*
+ * This file implements raidtop, a live view of a running array. It maps
+ * the metrics segment that raid_sim keeps in the file given with -S, takes
+ * a copy of it every interval and shows the difference between the last
+ * two copies: the IOPS, bandwidth, queue depth and read latency of every
+ * disk, the latency percentiles of the array, the cache tier hit rate and
+ * the progress of a rebuild.
+ *
+ * raidtop only reads the segment, so it adds nothing to the work of the
+ * controller no matter how often it samples.
+ */
+
+// Totals of all slots of the segment at one moment
+typedef struct {
+    metrics_slot_t sum;
+    double ms;
+} sample_t;
+
+/* Print usage information for the program, which has name prog_name.
+ */
+static void print_usage(char *prog_name) {
+    fprintf(stderr, "Usage: %s [-i seconds] [-n count] stats_file\n", prog_name);
+    fprintf(stderr, "  -i seconds  Time between updates (default: 1)\n");
+    fprintf(stderr, "  -n count    Exit after count updates instead of running until interrupted\n");
+    exit(1);
+}
+
+/* Return the current time of the monotonic clock in milliseconds.
+ */
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* Add up the slots of the segment m into s.
+ */
+static void take_sample(const metrics_t *m, sample_t *s) {
+    long long *total = (long long *)&s->sum;
+    memset(&s->sum, 0, sizeof(s->sum));
+    for (int i = 0; i < METRICS_SLOTS; i++) {
+        const long long *c = (const long long *)&m->slots[i];
+        for (size_t j = 0; j < sizeof(s->sum) / sizeof(long long); j++) {
+            total[j] += __atomic_load_n(&c[j], __ATOMIC_RELAXED);
+        }
+    }
+    s->ms = now_ms();
+}
+
+/* Return the upper bound in microseconds of the bucket that holds the
+ * fraction p of the count events in the histogram now minus then, or 0 if
+ * there were none.
+ */
+static long long percentile(const long long *now, const long long *then, double p) {
+    long long count = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        count += now[b] - then[b];
+    }
+    if (count == 0) {
+        return 0;
+    }
+    long long seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += now[b] - then[b];
+        if (seen >= p * count) {
+            return 1LL << b;
+        }
+    }
+    return 1LL << (METRICS_BUCKETS - 1);
+}
+
+/* Print one screen of the changes between the samples then and now of the
+ * array described by state.
+ */
+static void show(const metrics_state_t *state, const sample_t *then, const sample_t *now, int clear) {
+    const metrics_slot_t *a = &then->sum, *b = &now->sum;
+    double secs = (now->ms - then->ms) / 1000.0;
+    double mb = state->block_size / 1e6;
+    int alive = kill(state->pid, 0) == 0;
+
+    if (clear) {
+        printf("\033[H\033[2J");
+    }
+    printf("raidtop - array of %d data + %d parity disks, %d byte blocks, controller %d%s\n",
+           state->num_disks, state->num_parity, state->block_size, (int)state->pid, alive ? "" : " (exited)");
+
+    printf("%-6s %9s %9s %9s %8s %8s %8s\n", "", "IOPS", "MB/s", "p50 us", "p95 us", "p99 us", "errors");
+    for (int op = 0; op < METRICS_OPS; op++) {
+        long long n = b->requests[op] - a->requests[op];
+        printf("%-6s %9.0f %9.2f %9lld %8lld %8lld %8lld\n", op == METRICS_READ ? "read" : "write",
+               n / secs, (b->bytes[op] - a->bytes[op]) / secs / 1e6,
+               percentile(b->latency_buckets[op], a->latency_buckets[op], 0.50),
+               percentile(b->latency_buckets[op], a->latency_buckets[op], 0.95),
+               percentile(b->latency_buckets[op], a->latency_buckets[op], 0.99),
+               b->errors[op] - a->errors[op]);
+    }
+
+    printf("queue depth %lld (max %lld)", b->queue_depth, b->max_queue_depth);
+    if (state->tier_blocks > 0) {
+        long long hits = b->tier_hits - a->tier_hits;
+        long long reads = hits + b->tier_misses - a->tier_misses;
+        printf(", cache tier hit rate %.1f%%", reads > 0 ? 100.0 * hits / reads : 0.0);
+    }
+    long long rebuild_disk = __atomic_load_n(&state->rebuild_disk, __ATOMIC_RELAXED);
+    if (rebuild_disk != -1) {
+        long long total = state->rebuild_total > 0 ? state->rebuild_total : 1;
+        printf(", rebuilding disk %lld: %.1f%%", rebuild_disk, 100.0 * state->rebuild_done / total);
+    }
+    printf(", %lld rebuilds done\n\n", state->rebuilds);
+
+    printf("%-6s %-6s %9s %9s %9s %6s %9s %9s\n",
+           "disk", "state", "r IOPS", "w IOPS", "MB/s", "queue", "p50 us", "p99 us");
+    int total_disks = state->total_disks < METRICS_MAX_DISKS ? state->total_disks : METRICS_MAX_DISKS;
+    for (int d = 0; d < total_disks; d++) {
+        long long r = b->disk_requests[d][METRICS_READ] - a->disk_requests[d][METRICS_READ];
+        long long w = b->disk_requests[d][METRICS_WRITE] - a->disk_requests[d][METRICS_WRITE];
+        const char *role = d < state->num_disks ? "" : d < state->num_disks + state->num_parity ? "p" : "t";
+        char name[MAX_NAME];
+        snprintf(name, sizeof(name), "%d%s", d, role);
+        printf("%-6s %-6s %9.0f %9.0f %9.2f %6lld %9lld %9lld\n", name,
+               state->disk_failed[d] ? "FAILED" : "ok", r / secs, w / secs, (r + w) * mb / secs,
+               b->disk_queue[d],
+               percentile(b->disk_latency_buckets[d], a->disk_latency_buckets[d], 0.50),
+               percentile(b->disk_latency_buckets[d], a->disk_latency_buckets[d], 0.99));
+    }
+    fflush(stdout);
+}
+
+/* The main entry point for raidtop.
+ */
+int main(int argc, char **argv) {
+    double interval = 1.0;
+    int count = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:n:h")) != -1) {
+        switch (opt) {
+            case 'i':
+                interval = atof(optarg);
+                if (interval <= 0) {
+                    fprintf(stderr, "Error: Interval must be positive\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'n':
+                count = atoi(optarg);
+                if (count <= 0) {
+                    fprintf(stderr, "Error: Count must be positive\n");
+                    print_usage(argv[0]);
+                }
+                break;
+            case 'h':
+            default:
+                print_usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    // Mapping past the end of a shorter file would fault on the first read
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(metrics_t)) {
+        fprintf(stderr, "Error: %s is not a raid_sim stats file\n", argv[optind]);
+        close(fd);
+        return 1;
+    }
+    metrics_t *m = mmap(NULL, sizeof(metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (__atomic_load_n(&m->state.magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC) {
+        fprintf(stderr, "Error: %s is not a raid_sim stats file\n", argv[optind]);
+        return 1;
+    }
+
+    int clear = isatty(STDOUT_FILENO);
+    sample_t samples[2];
+    take_sample(m, &samples[0]);
+    for (int n = 0; count < 0 || n < count; n++) {
+        struct timespec ts = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+        nanosleep(&ts, NULL);
+        take_sample(m, &samples[(n + 1) % 2]);
+        show(&m->state, &samples[n % 2], &samples[(n + 1) % 2], clear);
+        if (!clear) {
+            printf("\n");
+        }
+    }
+    munmap(m, sizeof(metrics_t));
+    return 0;
+}
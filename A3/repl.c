@@ -0,0 +1,489 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "raid.h"
+
+/*
+ * This file implements asynchronous replication of the array to a second
+ * raid_sim instance, for disaster recovery.
+ *
+ * On the primary, every completed write is handed to a replicator process
+ * over a pipe, so the write itself never waits for the network. The
+ * replicator gathers the writes waiting in the pipe into a batch, compresses
+ * it with a run-length code and ships it to the secondary over a Unix
+ * socket, then reports the acknowledged batch back to the controller. The
+ * controller only blocks when more than REPL_MAX_LAG writes are waiting to
+ * be acknowledged, which bounds how much a disaster can lose. The limit is
+ * lowered if the pipe cannot hold that many writes.
+ *
+ * The secondary, started with -L, applies each batch with write_block
+ * before it acknowledges it.
+ */
+
+#define REPL_MAGIC 0x5245504c // "REPL"
+
+// A batch as it is sent to the secondary, followed by wire_len bytes of
+// run-length coded records. Each record is a block number and its data.
+typedef struct {
+    unsigned int magic;
+    unsigned int seq;
+    int count;
+    int raw_len;
+    int wire_len;
+} batch_header_t;
+
+// Progress reported by the replicator after every acknowledged batch
+typedef struct {
+    long long acked;        // Writes acknowledged by the secondary
+    long long batches;
+    long long raw_bytes;    // Size of the records before compression
+    long long wire_bytes;   // Size of the records on the wire
+    double ship_ms;         // Time spent waiting for the secondary
+} repl_progress_t;
+
+// Controller side state of the replicator
+static pid_t repl_pid = -1;
+static int repl_fd = -1;            // Records to the replicator
+static int repl_ack_fd = -1;        // Progress from the replicator
+static long long repl_sent;
+static int repl_window = REPL_MAX_LAG;  // Most writes waiting to be acknowledged
+static long long repl_max_lag;
+static long long repl_stalls;
+static double repl_start_ms;
+static repl_progress_t repl_progress;
+
+/* Compress len bytes of src into dst with a PackBits style run-length
+ * code: a control byte c < 128 is followed by c + 1 literal bytes, and
+ * c >= 128 by one byte repeated c - 125 times. dst must hold at least
+ * len + len / 128 + 1 bytes.
+ *
+ * Returns the number of bytes written to dst.
+ */
+static int rle_compress(const unsigned char *src, int len, unsigned char *dst) {
+    int in = 0, out = 0;
+    while (in < len) {
+        // Length of the run starting at in, up to the longest encodable
+        int run = 1;
+        while (in + run < len && run < 130 && src[in + run] == src[in]) {
+            run++;
+        }
+        if (run >= 3) {
+            dst[out++] = run + 125;
+            dst[out++] = src[in];
+            in += run;
+            continue;
+        }
+
+        // Gather literals until the next run of three or more
+        int start = in;
+        while (in < len && in - start < 128) {
+            if (in + 2 < len && src[in] == src[in + 1] && src[in] == src[in + 2]) {
+                break;
+            }
+            in++;
+        }
+        dst[out++] = in - start - 1;
+        memcpy(dst + out, src + start, in - start);
+        out += in - start;
+    }
+    return out;
+}
+
+/* Expand wire_len bytes of run-length code from src into dst, which holds
+ * raw_len bytes.
+ *
+ * Returns 0 on success and -1 if the code does not expand to raw_len bytes.
+ */
+static int rle_decompress(const unsigned char *src, int wire_len, unsigned char *dst, int raw_len) {
+    int in = 0, out = 0;
+    while (in < wire_len) {
+        int c = src[in++];
+        if (c < 128) {
+            if (in + c + 1 > wire_len || out + c + 1 > raw_len) {
+                return -1;
+            }
+            memcpy(dst + out, src + in, c + 1);
+            in += c + 1;
+            out += c + 1;
+        } else {
+            if (in >= wire_len || out + c - 125 > raw_len) {
+                return -1;
+            }
+            memset(dst + out, src[in++], c - 125);
+            out += c - 125;
+        }
+    }
+    return out == raw_len ? 0 : -1;
+}
+
+/* Main loop of the replicator process. Records are read from in, shipped to
+ * the secondary on sock in batches of up to REPL_BATCH_BLOCKS, and the
+ * progress is written to out after each acknowledged batch. A record with
+ * block number -1 asks the replicator to finish.
+ */
+static void run_replicator(int in, int out, int sock) {
+    flight_init("replicator");
+    int record_len = sizeof(int) + block_size;
+    char *raw = malloc((size_t)REPL_BATCH_BLOCKS * record_len);
+    unsigned char *wire = malloc((size_t)REPL_BATCH_BLOCKS * record_len
+                                 + REPL_BATCH_BLOCKS * record_len / 128 + 1);
+    if (raw == NULL || wire == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    repl_progress_t progress;
+    memset(&progress, 0, sizeof(progress));
+    unsigned int seq = 0;
+    int done = 0;
+
+    while (!done) {
+        // Wait for one record, then take whatever else is already queued
+        int count = 0;
+        struct pollfd pfd = { in, POLLIN, 0 };
+        while (count < REPL_BATCH_BLOCKS) {
+            if (count > 0 && poll(&pfd, 1, 0) <= 0) {
+                break;
+            }
+            char *record = raw + (size_t)count * record_len;
+            if (read_full(in, record, sizeof(int)) != sizeof(int)) {
+                done = 1;
+                break;
+            }
+            if (*(int *)record == -1) {
+                done = 1;
+                break;
+            }
+            if (read_full(in, record + sizeof(int), block_size) != block_size) {
+                done = 1;
+                break;
+            }
+            count++;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        batch_header_t header;
+        header.magic = REPL_MAGIC;
+        header.seq = ++seq;
+        header.count = count;
+        header.raw_len = count * record_len;
+        header.wire_len = rle_compress((unsigned char *)raw, header.raw_len, wire);
+
+        double start = monotonic_ms();
+        struct iovec iov[2] = {
+            { &header, sizeof(header) },
+            { wire, header.wire_len }
+        };
+        unsigned int ack;
+        if (writev_full(sock, iov, 2) != (ssize_t)(sizeof(header) + header.wire_len)
+                || read_full(sock, &ack, sizeof(ack)) != sizeof(ack) || ack != header.seq) {
+            fprintf(stderr, "Replicator: lost the connection to the secondary\n");
+            exit(1);
+        }
+        progress.ship_ms += monotonic_ms() - start;
+        progress.acked += count;
+        progress.batches++;
+        progress.raw_bytes += header.raw_len;
+        progress.wire_bytes += sizeof(header) + header.wire_len;
+        if (write_full(out, &progress, sizeof(progress)) != sizeof(progress)) {
+            exit(1);
+        }
+    }
+    close(sock);
+    exit(0);
+}
+
+/* Connect to the secondary listening on path and start the replicator
+ * process. This must be called before the disks are started so that the
+ * replicator does not hold their channels open.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int start_replicator(const char *path) {
+    int sock = unix_connect(path);
+    if (sock == -1) {
+        fprintf(stderr, "Error: Cannot connect to the secondary at %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int to_repl[2], from_repl[2];
+    if (pipe(to_repl) == -1 || pipe(from_repl) == -1) {
+        perror("pipe");
+        close(sock);
+        return -1;
+    }
+#ifdef F_SETPIPE_SZ
+    // Let a full window of writes sit in the pipe without blocking. If the
+    // pipe cannot grow that far, the window shrinks to what it holds.
+    int record_size = (int)sizeof(int) + block_size;
+    if (fcntl(to_repl[1], F_SETPIPE_SZ, REPL_MAX_LAG * record_size) == -1) {
+        int pipe_size = fcntl(to_repl[1], F_GETPIPE_SZ);
+        if (pipe_size != -1 && pipe_size / record_size < REPL_MAX_LAG) {
+            repl_window = pipe_size / record_size > 0 ? pipe_size / record_size : 1;
+            fprintf(stderr, "Warning: The replication pipe only holds %d writes, lowering the lag limit\n",
+                    repl_window);
+        }
+    }
+#endif
+
+    fflush(stdout);
+    repl_pid = fork();
+    if (repl_pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (repl_pid == 0) {
+        close(to_repl[1]);
+        close(from_repl[0]);
+        run_replicator(to_repl[0], from_repl[1], sock);
+    }
+
+    close(sock);
+    close(to_repl[0]);
+    close(from_repl[1]);
+    repl_fd = to_repl[1];
+    repl_ack_fd = from_repl[0];
+    fcntl(repl_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(repl_ack_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(repl_ack_fd, F_SETFL, O_NONBLOCK);
+    repl_start_ms = monotonic_ms();
+    return 0;
+}
+
+/* Close the controller's ends of the replicator's pipes. Called in a newly
+ * forked disk process, which would otherwise keep the pipe to the
+ * replicator open.
+ */
+void close_replicator_fds() {
+    if (repl_fd != -1) {
+        close(repl_fd);
+        repl_fd = -1;
+    }
+    if (repl_ack_fd != -1) {
+        close(repl_ack_fd);
+        repl_ack_fd = -1;
+    }
+}
+
+/* Take in the progress reports the replicator has written so far. When
+ * wait is set, block until at least one arrives.
+ *
+ * Returns 0 on success and -1 if the replicator has gone away.
+ */
+static int read_progress(int wait) {
+    if (wait) {
+        struct pollfd pfd = { repl_ack_fd, POLLIN, 0 };
+        while (poll(&pfd, 1, -1) == -1) {
+            if (errno != EINTR) {
+                return -1;
+            }
+        }
+    }
+    repl_progress_t progress[16];
+    while (1) {
+        ssize_t r = read(repl_ack_fd, progress, sizeof(progress));
+        if (r > 0) {
+            // Reports are written whole, so only the last one matters
+            repl_progress = progress[r / sizeof(repl_progress_t) - 1];
+            continue;
+        }
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+/* Stop replicating after a failure of the replicator.
+ */
+static void abandon_replication() {
+    fprintf(stderr, "Error: Replication stopped, the secondary is out of date\n");
+    close(repl_fd);
+    close(repl_ack_fd);
+    repl_fd = repl_ack_fd = -1;
+    waitpid(repl_pid, NULL, 0);
+    repl_pid = -1;
+}
+
+/* Queue the completed write of data to block_num for the secondary. This
+ * only waits if the secondary is more than repl_window writes behind.
+ */
+void replicate_write(int block_num, const char *data) {
+    if (repl_fd == -1) {
+        return;
+    }
+    struct iovec iov[2] = {
+        { &block_num, sizeof(block_num) },
+        { (char *)data, block_size }
+    };
+    if (writev_full(repl_fd, iov, 2) != (ssize_t)(sizeof(block_num) + block_size)) {
+        abandon_replication();
+        return;
+    }
+    repl_sent++;
+
+    if (read_progress(0) == -1) {
+        abandon_replication();
+        return;
+    }
+    if (repl_sent - repl_progress.acked > repl_window) {
+        repl_stalls++;
+        while (repl_sent - repl_progress.acked > repl_window) {
+            if (read_progress(1) == -1) {
+                abandon_replication();
+                return;
+            }
+        }
+    }
+    if (repl_sent - repl_progress.acked > repl_max_lag) {
+        repl_max_lag = repl_sent - repl_progress.acked;
+    }
+}
+
+/* Print the replication lag, batching and throughput figures.
+ */
+void print_repl_stats() {
+    if (repl_pid == -1) {
+        printf("Replication is not enabled\n");
+        return;
+    }
+    read_progress(0);
+    repl_progress_t *p = &repl_progress;
+    double secs = (monotonic_ms() - repl_start_ms) / 1000.0;
+    printf("Replication: %lld writes sent, %lld acknowledged, lag %lld writes (max %lld, limit %d)\n",
+           repl_sent, p->acked, repl_sent - p->acked, repl_max_lag, repl_window);
+    printf("  %lld batches, %.1f writes per batch, %.2fx compression, %.1f ms per batch\n",
+           p->batches, p->batches > 0 ? (double)p->acked / p->batches : 0.0,
+           p->wire_bytes > 0 ? (double)p->raw_bytes / p->wire_bytes : 0.0,
+           p->batches > 0 ? p->ship_ms / p->batches : 0.0);
+    printf("  %.2f MB/s replicated, %.2f MB/s on the wire, %lld stalls at the lag limit\n",
+           secs > 0 ? p->acked * (double)block_size / secs / 1e6 : 0.0,
+           secs > 0 ? p->wire_bytes / secs / 1e6 : 0.0, repl_stalls);
+}
+
+/* Ship every queued write to the secondary and stop the replicator.
+ */
+void stop_replicator() {
+    if (repl_pid == -1) {
+        return;
+    }
+    double start = monotonic_ms();
+    read_progress(0);
+    long long pending = repl_sent - repl_progress.acked;
+    int stop = -1;
+    if (write_full(repl_fd, &stop, sizeof(stop)) != sizeof(stop)) {
+        fprintf(stderr, "Warning: Failed to stop the replicator\n");
+    }
+    if (waitpid(repl_pid, NULL, 0) == -1) {
+        perror("stop_replicator: waitpid");
+    }
+    read_progress(0);
+    close(repl_fd);
+    close(repl_ack_fd);
+    repl_pid = -1;
+    if (debug) {
+        printf("Replication drained %lld writes in %.1f ms\n", pending, monotonic_ms() - start);
+    }
+}
+
+/* Act as the secondary of a replicated array: accept the primary's
+ * replicator on the Unix socket path and apply its batches until it
+ * disconnects.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int serve_replica(const char *path) {
+    int listen_fd = unix_listen(path);
+    if (listen_fd == -1) {
+        return -1;
+    }
+    if (debug) {
+        printf("Waiting for the primary on %s\n", path);
+        fflush(stdout);
+    }
+    int conn;
+    while ((conn = accept(listen_fd, NULL, NULL)) == -1 && errno == EINTR) {
+    }
+    close(listen_fd);
+    unlink(path);
+    if (conn == -1) {
+        perror("accept");
+        return -1;
+    }
+
+    int record_len = sizeof(int) + block_size;
+    char *raw = malloc((size_t)REPL_BATCH_BLOCKS * record_len);
+    unsigned char *wire = malloc((size_t)REPL_BATCH_BLOCKS * record_len
+                                 + REPL_BATCH_BLOCKS * record_len / 128 + 1);
+    if (raw == NULL || wire == NULL) {
+        perror("malloc");
+        free(raw);
+        free(wire);
+        close(conn);
+        return -1;
+    }
+
+    long long blocks = 0, batches = 0;
+    int status = 0;
+    double start = monotonic_ms();
+    batch_header_t header;
+    ssize_t r;
+    while ((r = read_full(conn, &header, sizeof(header))) == sizeof(header)) {
+        if (header.magic != REPL_MAGIC || header.count <= 0 || header.count > REPL_BATCH_BLOCKS
+                || header.raw_len != header.count * record_len
+                || header.wire_len <= 0 || header.wire_len > header.raw_len + header.raw_len / 128 + 1
+                || read_full(conn, wire, header.wire_len) != header.wire_len
+                || rle_decompress(wire, header.wire_len, (unsigned char *)raw, header.raw_len) == -1) {
+            fprintf(stderr, "Error: Corrupt replication batch\n");
+            status = -1;
+            break;
+        }
+        for (int i = 0; i < header.count; i++) {
+            char *record = raw + (size_t)i * record_len;
+            if (write_block(*(int *)record, record + sizeof(int)) == -1) {
+                status = -1;
+            }
+        }
+        // Acknowledge only once the batch is applied
+        if (write_full(conn, &header.seq, sizeof(header.seq)) != sizeof(header.seq)) {
+            status = -1;
+            break;
+        }
+        blocks += header.count;
+        batches++;
+    }
+    if (r == -1) {
+        status = -1;
+    }
+    if (debug) {
+        printf("Replica applied %lld writes in %lld batches in %.1f ms\n",
+               blocks, batches, monotonic_ms() - start);
+    }
+    free(raw);
+    free(wire);
+    close(conn);
+    return status;
+}
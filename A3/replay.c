@@ -0,0 +1,298 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "raid.h"
+
+/*
+ * This file replays block I/O traces against the array, so that it can be
+ * measured under the load of a real application instead of a synthetic one.
+ * Two text formats are read:
+ *
+ * - fio iologs of version 2 ("filename action offset length") and version 3
+ *   ("timestamp filename action offset length", timestamps in milliseconds).
+ *   Actions other than read and write are skipped.
+ * - The default output of blkparse ("dev cpu seq seconds pid action rwbs
+ *   sector + count [process]"). The queue (Q) events are replayed, or the
+ *   issue (D) events of a trace that has no queue events. Sectors are 512
+ *   bytes.
+ *
+ * Every request is split into the blocks it covers, and offsets beyond the
+ * end of the array wrap around. Writes replace the data of the array.
+ *
+ * The trace is loaded before the replay starts, so parsing does not disturb
+ * the timing. A timed replay issues each request at its original offset
+ * from the start of the trace. The latency of a request is measured from
+ * that time rather than from when it was issued, so a replay that falls
+ * behind shows the queueing delay a real application would have seen.
+ */
+
+#define SECTOR_SIZE 512
+#define MAX_LINE 512
+
+typedef struct {
+    double ms;              // Time of the request from the start of the trace
+    int write;
+    long long offset;       // In bytes
+    long long length;
+} trace_request_t;
+
+typedef struct {
+    trace_request_t *requests;
+    int count;
+    int capacity;
+    int timed;              // Set if the trace has timestamps
+} trace_t;
+
+/* Append a request to trace.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int add_request(trace_t *trace, double ms, int write, long long offset, long long length) {
+    if (trace->count == trace->capacity) {
+        int capacity = trace->capacity > 0 ? trace->capacity * 2 : 1024;
+        trace_request_t *requests = realloc(trace->requests, capacity * sizeof(trace_request_t));
+        if (requests == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        trace->requests = requests;
+        trace->capacity = capacity;
+    }
+    trace_request_t *r = &trace->requests[trace->count++];
+    r->ms = ms;
+    r->write = write;
+    r->offset = offset;
+    r->length = length;
+    return 0;
+}
+
+/* Parse the body of a fio iolog of the given version from fp into trace.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int parse_fio(FILE *fp, int version, trace_t *trace) {
+    char line[MAX_LINE];
+    trace->timed = version == 3;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char action[MAX_NAME];
+        long long offset, length;
+        double ms = 0;
+        int n;
+        if (version == 3) {
+            n = sscanf(line, "%lf %*s %31s %lld %lld", &ms, action, &offset, &length) == 4;
+        } else {
+            n = sscanf(line, "%*s %31s %lld %lld", action, &offset, &length) == 3;
+        }
+        // File actions (add, open, close) and trim or sync are not replayed
+        if (!n || (strcmp(action, "read") != 0 && strcmp(action, "write") != 0)) {
+            continue;
+        }
+        if (add_request(trace, ms, action[0] == 'w', offset, length) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Parse blkparse output from fp into trace, keeping the events of action
+ * ('Q' or 'D').
+ *
+ * Returns the number of lines that held an event of any action on success
+ * and -1 on failure.
+ */
+static int parse_blkparse(FILE *fp, char action, trace_t *trace) {
+    char line[MAX_LINE];
+    int events = 0;
+    double first = -1;
+    trace->timed = 1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        int major, minor, cpu, pid, count;
+        unsigned int seq;
+        double secs;
+        char act[8], rwbs[8];
+        long long sector;
+        if (sscanf(line, "%d,%d %d %u %lf %d %7s %7s %lld + %d", &major, &minor, &cpu, &seq, &secs,
+                   &pid, act, rwbs, &sector, &count) != 10) {
+            continue;
+        }
+        events++;
+        if (act[0] != action || act[1] != '\0') {
+            continue;
+        }
+        // Flushes, discards and other requests without data are skipped
+        int write = strchr(rwbs, 'W') != NULL;
+        if (!write && strchr(rwbs, 'R') == NULL) {
+            continue;
+        }
+        if (first < 0) {
+            first = secs;
+        }
+        if (add_request(trace, (secs - first) * 1000.0, write, sector * SECTOR_SIZE,
+                        (long long)count * SECTOR_SIZE) == -1) {
+            return -1;
+        }
+    }
+    return events;
+}
+
+/* Load the trace in the file at path into trace, working out its format
+ * from its first line.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int load_trace(const char *path, trace_t *trace) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    memset(trace, 0, sizeof(*trace));
+
+    char line[MAX_LINE];
+    int version;
+    int status = 0;
+    if (fgets(line, sizeof(line), fp) != NULL && sscanf(line, "fio version %d iolog", &version) == 1) {
+        if (version != 2 && version != 3) {
+            fprintf(stderr, "Error: fio iolog version %d is not supported\n", version);
+            status = -1;
+        } else {
+            status = parse_fio(fp, version, trace);
+        }
+    } else {
+        rewind(fp);
+        int events = parse_blkparse(fp, 'Q', trace);
+        if (events > 0 && trace->count == 0) {
+            rewind(fp);
+            events = parse_blkparse(fp, 'D', trace);
+        }
+        if (events == 0) {
+            fprintf(stderr, "Error: %s is neither a fio iolog nor blkparse output\n", path);
+        }
+        status = events > 0 ? 0 : -1;
+    }
+    fclose(fp);
+    if (status == -1) {
+        free(trace->requests);
+    }
+    return status;
+}
+
+/* Compare two latencies for qsort.
+ */
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Print the count and latency percentiles in microseconds of the n
+ * latencies in ms, which are sorted in place.
+ */
+static void print_latency(const char *label, double *ms, int n) {
+    if (n == 0) {
+        return;
+    }
+    qsort(ms, n, sizeof(double), compare_double);
+    printf("  %-6s %8d requests, latency us: p50 %.1f p95 %.1f p99 %.1f max %.1f\n", label, n,
+           ms[n / 2] * 1000.0, ms[(int)(n * 0.95)] * 1000.0, ms[(int)(n * 0.99)] * 1000.0, ms[n - 1] * 1000.0);
+}
+
+/* Sleep until the monotonic clock reaches ms.
+ */
+static void sleep_until(double ms) {
+    double wait = ms - monotonic_ms();
+    if (wait > 0) {
+        long long ns = (long long)(wait * 1e6);
+        struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Replay the block trace in the file at path against the array, either as
+ * fast as possible or, if timed is set, at the times it was recorded, and
+ * print the throughput and latency percentiles of the reads and writes.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int replay_trace(const char *path, int timed) {
+    trace_t trace;
+    if (load_trace(path, &trace) == -1) {
+        return -1;
+    }
+    if (timed && !trace.timed) {
+        printf("The trace has no timestamps; replaying it as fast as possible\n");
+        timed = 0;
+    }
+
+    int num_blocks = disk_size / block_size;
+    char *buf = malloc(block_size);
+    double *latency[METRICS_OPS];
+    latency[METRICS_READ] = malloc(trace.count * sizeof(double) + 1);
+    latency[METRICS_WRITE] = malloc(trace.count * sizeof(double) + 1);
+    if (buf == NULL || latency[METRICS_READ] == NULL || latency[METRICS_WRITE] == NULL) {
+        perror("malloc");
+        free(buf);
+        free(latency[METRICS_READ]);
+        free(latency[METRICS_WRITE]);
+        free(trace.requests);
+        return -1;
+    }
+    memset(buf, 0xa5, block_size);
+
+    int counts[METRICS_OPS] = {0, 0};
+    long long blocks = 0;
+    int errors = 0, late = 0;
+    double start = monotonic_ms();
+    for (int i = 0; i < trace.count; i++) {
+        trace_request_t *r = &trace.requests[i];
+        double due = timed ? start + r->ms : monotonic_ms();
+        if (timed) {
+            sleep_until(due);
+            late += monotonic_ms() - due > 1.0;
+        }
+
+        long long first = r->offset / block_size;
+        long long last = (r->offset + (r->length > 0 ? r->length : 1) - 1) / block_size;
+        for (long long b = first; b <= last; b++) {
+            int block_num = b % num_blocks;
+            if (r->write ? write_block(block_num, buf) != 0 : read_block(block_num, buf) == NULL) {
+                errors++;
+            }
+            blocks++;
+        }
+        int op = r->write ? METRICS_WRITE : METRICS_READ;
+        latency[op][counts[op]++] = monotonic_ms() - due;
+        tier_idle();
+    }
+    double ms = monotonic_ms() - start;
+
+    printf("replay %s: %d requests (%d reads, %d writes), %lld blocks in %.1f ms, %.0f IOPS, %.2f MB/s\n",
+           timed ? "timed" : "fast", trace.count, counts[METRICS_READ], counts[METRICS_WRITE], blocks, ms,
+           ms > 0 ? trace.count * 1000.0 / ms : 0.0, ms > 0 ? blocks * block_size / ms / 1000.0 : 0.0);
+    if (timed && trace.count > 0) {
+        printf("  trace spans %.1f ms, %d requests started over 1 ms late\n", trace.requests[trace.count - 1].ms, late);
+    }
+    print_latency("read", latency[METRICS_READ], counts[METRICS_READ]);
+    print_latency("write", latency[METRICS_WRITE], counts[METRICS_WRITE]);
+    if (errors > 0) {
+        printf("(%d errors)\n", errors);
+    }
+
+    free(buf);
+    free(latency[METRICS_READ]);
+    free(latency[METRICS_WRITE]);
+    free(trace.requests);
+    return errors > 0 ? -1 : 0;
+}
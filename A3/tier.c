@@ -0,0 +1,484 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raid.h"
+
+/*
+ * This file implements the cache tier of a two-tier array: a small RAID 1
+ * pair of fast disks in front of the parity protected capacity disks.
+ *
+ * Every write is absorbed by the tier, which only costs a write to each
+ * mirror, and the block is marked dirty. A read that misses the tier is
+ * served by the capacity disks. The block is only promoted into the tier if
+ * its extent is hot (see heat.c), so that a scan of cold blocks does not
+ * flush the tier; the rest of a hot extent is then migrated into the tier
+ * in the background.
+ *
+ * When the tier is full, the clock algorithm picks a victim, preferring
+ * clean blocks; a dirty victim has its stripe destaged first.
+ *
+ * Destaging writes a whole stripe at once, using the tier's copy of every
+ * block of the stripe it holds. When the tier holds all of them the parity
+ * is computed without reading the capacity disks at all. Between commands
+ * the destager writes back the stripes with the most dirty blocks while
+ * more than TIER_LOW_WATERMARK of the tier is dirty, and then migrates the
+ * hot extents that are waiting.
+ *
+ * The map from slots to blocks lives only in the controller, so the tier is
+ * flushed to the capacity disks on exit, on detach and before every
+ * checkpoint.
+ */
+
+static int *slot_block;             // Block held by each slot, or -1
+static int *block_slot;             // Slot holding each block, or -1
+static unsigned char *slot_dirty;   // Set while the capacity disks are stale
+static unsigned char *slot_ref;     // Clock reference bit
+static int *stripe_dirty;           // Dirty blocks held for each stripe
+static int num_blocks;
+static int num_stripes;
+static int num_dirty;
+static int clock_hand;
+static int bypass;
+static int mirrors_lost;            // Set once both mirrors have failed
+static int promote_all;             // Promote on every miss, whatever the heat
+static int migrate_queue[TIER_MIGRATE_QUEUE];
+static int num_migrating;
+static char *destage_buf;           // One block per data disk
+static char *migrate_buf;           // One block being migrated
+
+// Tier statistics, reset by reset_tier_stats
+static long long read_hits;
+static long long read_misses;
+static long long promotions;
+static long long cold_misses;
+static long long migrated_extents;
+static long long migrated_blocks;
+static long long absorbed;
+static long long evictions;
+static long long full_destages;
+static long long partial_destages;
+static long long destaged_blocks;
+static long long tier_writes;
+static double tier_write_ms;
+static long long capacity_writes;
+static double capacity_write_ms;
+
+/* Set up an empty cache tier of blocks slots, one per block of the mirrors.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int init_tier(int blocks) {
+    if (blocks > disk_size / block_size) {
+        fprintf(stderr, "Error: The cache tier holds at most %d blocks\n", disk_size / block_size);
+        return -1;
+    }
+    num_blocks = disk_size / block_size;
+    num_stripes = (num_blocks + num_disks - 1) / num_disks;
+    slot_block = malloc(blocks * sizeof(int));
+    block_slot = malloc(num_blocks * sizeof(int));
+    slot_dirty = calloc(blocks, 1);
+    slot_ref = calloc(blocks, 1);
+    stripe_dirty = calloc(num_stripes, sizeof(int));
+    destage_buf = malloc((size_t)num_disks * block_size);
+    migrate_buf = malloc(block_size);
+    if (slot_block == NULL || block_slot == NULL || slot_dirty == NULL || slot_ref == NULL
+            || stripe_dirty == NULL || destage_buf == NULL || migrate_buf == NULL) {
+        perror("malloc");
+        free(slot_block);
+        free(block_slot);
+        free(slot_dirty);
+        free(slot_ref);
+        free(stripe_dirty);
+        free(destage_buf);
+        free(migrate_buf);
+        slot_block = block_slot = stripe_dirty = NULL;
+        slot_dirty = slot_ref = NULL;
+        destage_buf = migrate_buf = NULL;
+        return -1;
+    }
+    for (int i = 0; i < blocks; i++) {
+        slot_block[i] = -1;
+    }
+    for (int i = 0; i < num_blocks; i++) {
+        block_slot[i] = -1;
+    }
+    tier_blocks = blocks;
+    return 0;
+}
+
+/* Return 1 if the array has a cache tier and 0 otherwise.
+ */
+int tier_enabled() {
+    return tier_blocks > 0;
+}
+
+/* Write every block of stripe that the tier holds back to the capacity
+ * disks in one stripe write, and mark them clean.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int destage_stripe(int stripe) {
+    char *blocks[num_disks];
+    int held = 0;
+    for (int i = 0; i < num_disks; i++) {
+        int block_num = stripe * num_disks + i;
+        blocks[i] = NULL;
+        if (block_num >= num_blocks || block_slot[block_num] == -1) {
+            continue;
+        }
+        blocks[i] = destage_buf + (size_t)i * block_size;
+        if (read_tier_block(block_slot[block_num], blocks[i]) == -1) {
+            return -1;
+        }
+        held++;
+    }
+    if (write_stripe(stripe, blocks) == -1) {
+        return -1;
+    }
+
+    if (held == num_disks) {
+        full_destages++;
+    } else {
+        partial_destages++;
+    }
+    for (int i = 0; i < num_disks; i++) {
+        int block_num = stripe * num_disks + i;
+        if (blocks[i] != NULL && slot_dirty[block_slot[block_num]]) {
+            slot_dirty[block_slot[block_num]] = 0;
+            num_dirty--;
+            destaged_blocks++;
+        }
+    }
+    stripe_dirty[stripe] = 0;
+    return 0;
+}
+
+/* Remove the block held by slot from the tier, which leaves it free. A
+ * dirty block is dropped, so the caller must have written it elsewhere.
+ */
+static void evict_slot(int slot) {
+    if (slot_block[slot] != -1) {
+        if (slot_dirty[slot]) {
+            slot_dirty[slot] = 0;
+            num_dirty--;
+            stripe_dirty[slot_block[slot] / num_disks]--;
+        }
+        block_slot[slot_block[slot]] = -1;
+        slot_block[slot] = -1;
+        evictions++;
+    }
+}
+
+/* Find a slot for a new block, evicting the block in it if needed. Free
+ * and clean slots whose reference bit is clear are taken first; if every
+ * slot is dirty, the stripe of the slot under the clock hand is destaged.
+ *
+ * Returns the slot on success and -1 on failure.
+ */
+static int alloc_slot() {
+    for (int n = 0; n < 2 * tier_blocks; n++) {
+        int slot = clock_hand;
+        clock_hand = (clock_hand + 1) % tier_blocks;
+        if (slot_block[slot] == -1) {
+            return slot;
+        }
+        if (slot_ref[slot]) {
+            slot_ref[slot] = 0;
+        } else if (!slot_dirty[slot]) {
+            evict_slot(slot);
+            return slot;
+        }
+    }
+
+    int slot = clock_hand;
+    clock_hand = (clock_hand + 1) % tier_blocks;
+    if (destage_stripe(slot_block[slot] / num_disks) == -1) {
+        return -1;
+    }
+    evict_slot(slot);
+    return slot;
+}
+
+/* Copy data, the current contents of block_num, into a slot of the tier as
+ * a clean block.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int promote_block(int block_num, char *data) {
+    int slot = alloc_slot();
+    if (slot == -1 || write_tier_block(slot, data) == -1) {
+        return -1;
+    }
+    block_slot[block_num] = slot;
+    slot_block[slot] = block_num;
+    return 0;
+}
+
+/* Write data to block_num through the cache tier. The block is written to
+ * both mirrors and reaches the capacity disks when its stripe is destaged.
+ * With the tier bypassed the block goes straight to the capacity disks.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int tier_write(int block_num, char *data) {
+    double start = monotonic_ms();
+    int slot = block_slot[block_num];
+    if (bypass) {
+        // This write supersedes the tier copy, so it can simply be dropped
+        if (slot != -1) {
+            evict_slot(slot);
+        }
+    } else if (slot != -1 || (slot = alloc_slot()) != -1) {
+        if (write_tier_block(slot, data) == 0) {
+            block_slot[block_num] = slot;
+            slot_block[slot] = block_num;
+            slot_ref[slot] = 1;
+            if (!slot_dirty[slot]) {
+                slot_dirty[slot] = 1;
+                num_dirty++;
+                stripe_dirty[block_num / num_disks]++;
+            }
+            absorbed++;
+            tier_writes++;
+            tier_write_ms += monotonic_ms() - start;
+            return 0;
+        }
+        // Both mirrors are gone, so bypass the tier from now on. This block
+        // goes to the capacity disks, but the other dirty blocks are lost.
+        evict_slot(slot);
+        mirrors_lost = 1;
+        bypass = 1;
+        if (num_dirty > 0) {
+            fprintf(stderr, "Error: The latest writes to %d blocks were lost with the cache tier\n", num_dirty);
+        }
+    }
+
+    if (capacity_write(block_num, data) == -1) {
+        return -1;
+    }
+    capacity_writes++;
+    capacity_write_ms += monotonic_ms() - start;
+    return 0;
+}
+
+/* Return the number of blocks of extent that are in the tier.
+ */
+int tier_extent_blocks(int extent) {
+    int held = 0;
+    for (int i = 0; i < num_disks; i++) {
+        int block_num = extent * num_disks + i;
+        held += block_num < num_blocks && block_slot[block_num] != -1;
+    }
+    return held;
+}
+
+/* Queue extent to have the rest of its blocks migrated into the tier,
+ * unless it is already queued or the queue is full.
+ */
+static void queue_migration(int extent) {
+    for (int i = 0; i < num_migrating; i++) {
+        if (migrate_queue[i] == extent) {
+            return;
+        }
+    }
+    if (num_migrating < TIER_MIGRATE_QUEUE && tier_extent_blocks(extent) < num_disks) {
+        migrate_queue[num_migrating++] = extent;
+    }
+}
+
+/* Copy every block of extent that is not in the tier from the capacity
+ * disks into the tier as a clean block.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+static int migrate_extent(int extent) {
+    char *data = migrate_buf;
+    for (int i = 0; i < num_disks; i++) {
+        int block_num = extent * num_disks + i;
+        if (block_num >= num_blocks || block_slot[block_num] != -1) {
+            continue;
+        }
+        if (capacity_read(block_num, data) == NULL || promote_block(block_num, data) == -1) {
+            return -1;
+        }
+        migrated_blocks++;
+    }
+    migrated_extents++;
+    return 0;
+}
+
+/* Read block_num into data through the cache tier. A block that is not in
+ * the tier is read from the capacity disks, and promoted into the tier if
+ * its extent is hot. A dirty block is always read from the tier, bypassed
+ * or not, since the capacity disks hold an older copy; if the mirrors are
+ * gone the read fails rather than return that copy.
+ *
+ * Returns a pointer to the data buffer on success and NULL on failure.
+ */
+char *tier_read(int block_num, char *data) {
+    int slot = block_slot[block_num];
+    if (slot != -1 && (!bypass || slot_dirty[slot])) {
+        if (read_tier_block(slot, data) == -1) {
+            return NULL;
+        }
+        read_hits++;
+        metrics_tier(1);
+        slot_ref[slot] = 1;
+        return data;
+    }
+
+    if (capacity_read(block_num, data) == NULL) {
+        return NULL;
+    }
+    if (bypass) {
+        return data;
+    }
+    read_misses++;
+    metrics_tier(0);
+    if (!promote_all && !heat_is_hot(block_num)) {
+        cold_misses++;
+        return data;
+    }
+    if (promote_block(block_num, data) == 0) {
+        promotions++;
+    }
+    if (!promote_all) {
+        queue_migration(block_num / num_disks);
+    }
+    return data;
+}
+
+/* Return the stripe with the most dirty blocks in the tier, or -1 if no
+ * block is dirty.
+ */
+static int dirtiest_stripe() {
+    int best = -1;
+    for (int stripe = 0; stripe < num_stripes; stripe++) {
+        if (stripe_dirty[stripe] > 0 && (best == -1 || stripe_dirty[stripe] > stripe_dirty[best])) {
+            best = stripe;
+            if (stripe_dirty[best] == num_disks) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/* Destage up to TIER_DESTAGE_BATCH of the dirtiest stripes while more than
+ * TIER_LOW_WATERMARK of the tier is dirty, then migrate up to as many of the
+ * hot extents waiting in the queue. This is called between commands so that
+ * the background work stays off the path of the requests themselves.
+ */
+void tier_idle() {
+    if (!tier_enabled() || bypass) {
+        return;
+    }
+    for (int n = 0; n < TIER_DESTAGE_BATCH; n++) {
+        if (num_dirty <= TIER_LOW_WATERMARK * tier_blocks) {
+            break;
+        }
+        int stripe = dirtiest_stripe();
+        if (stripe == -1 || destage_stripe(stripe) == -1) {
+            break;
+        }
+    }
+    for (int n = 0; n < TIER_DESTAGE_BATCH && num_migrating > 0; n++) {
+        int extent = migrate_queue[0];
+        memmove(migrate_queue, migrate_queue + 1, --num_migrating * sizeof(int));
+        if (migrate_extent(extent) == -1) {
+            break;
+        }
+    }
+}
+
+/* Destage every dirty block in the tier to the capacity disks.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int tier_flush() {
+    if (!tier_enabled()) {
+        return 0;
+    }
+    if (mirrors_lost) {
+        if (num_dirty > 0) {
+            fprintf(stderr, "Error: The latest writes to %d blocks were lost with the cache tier\n", num_dirty);
+            return -1;
+        }
+        return 0;
+    }
+    for (int stripe = 0; stripe < num_stripes; stripe++) {
+        if (stripe_dirty[stripe] > 0 && destage_stripe(stripe) == -1) {
+            fprintf(stderr, "Failed to destage stripe %d of the cache tier\n", stripe);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Send all writes straight to the capacity disks if bypass is set, or
+ * through the tier otherwise. The tier is flushed first, so that the
+ * capacity disks stay current while it is bypassed. A tier that has lost
+ * both mirrors stays bypassed.
+ */
+void set_tier_bypass(int on) {
+    if (on) {
+        tier_flush();
+        num_migrating = 0;
+    }
+    bypass = on || mirrors_lost;
+}
+
+/* Promote every block that misses the tier if all is set, as a plain cache
+ * would, instead of only the blocks of hot extents.
+ */
+void set_tier_promote_all(int all) {
+    promote_all = all;
+}
+
+/* Clear the tier statistics.
+ */
+void reset_tier_stats() {
+    read_hits = read_misses = promotions = cold_misses = absorbed = evictions = 0;
+    migrated_extents = migrated_blocks = 0;
+    full_destages = partial_destages = destaged_blocks = 0;
+    tier_writes = capacity_writes = 0;
+    tier_write_ms = capacity_write_ms = 0.0;
+}
+
+/* Print the hit rate of the tier, the destages it has done and the average
+ * latency of the writes it absorbed and of the writes that went to the
+ * capacity disks.
+ */
+void print_tier_stats() {
+    if (!tier_enabled()) {
+        printf("No cache tier\n");
+        return;
+    }
+    long long reads = read_hits + read_misses;
+    int used = 0;
+    for (int i = 0; i < tier_blocks; i++) {
+        used += slot_block[i] != -1;
+    }
+    printf("tier: %d/%d slots used, %d dirty%s\n", used, tier_blocks, num_dirty, bypass ? " (bypassed)" : "");
+    printf("tier reads: %lld hits, %lld misses, %.1f%% hit rate, %lld promoted, %lld too cold to promote\n",
+           read_hits, read_misses, reads > 0 ? 100.0 * read_hits / reads : 0.0, promotions, cold_misses);
+    printf("tier migration: %lld hot extents, %lld blocks\n", migrated_extents, migrated_blocks);
+    printf("tier writes: %lld absorbed, %lld evictions\n", absorbed, evictions);
+    printf("tier destages: %lld full stripes, %lld partial stripes, %lld blocks\n",
+           full_destages, partial_destages, destaged_blocks);
+    printf("write latency: tier %.1f us (%lld writes), capacity %.1f us (%lld writes)\n",
+           tier_writes > 0 ? tier_write_ms * 1000.0 / tier_writes : 0.0, tier_writes,
+           capacity_writes > 0 ? capacity_write_ms * 1000.0 / capacity_writes : 0.0, capacity_writes);
+}
@@ -0,0 +1,142 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "raid.h"
+
+/*
+ * This file implements the controller's worker pool, which runs batches of
+ * independent requests at the same time so that the waits for different
+ * disks overlap.
+ *
+ * Every job of a batch has a key, the stripe it touches. Jobs with the same
+ * key run one after the other in batch order, since each may read what the
+ * one before it wrote and both rewrite the stripe's parity; jobs with
+ * different keys run in any order on any worker. The dependencies of a
+ * batch form one chain per key, so a job has at most one successor, which
+ * becomes ready when the job finishes.
+ *
+ * Each worker counts its requests in a metrics slot of its own.
+ */
+
+static pthread_t threads[MAX_WORKERS];
+static int num_threads;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+
+// The batch being run and the queue of its jobs that are ready
+static job_t *batch;
+static int ready[WORKER_BATCH];
+static int ready_head, ready_tail;
+static int remaining;
+static int stopping;
+
+/* Queue job i of the batch to be run. The lock must be held.
+ */
+static void push_ready(int i) {
+    ready[ready_tail++ % WORKER_BATCH] = i;
+    pthread_cond_signal(&work_ready);
+}
+
+/* Take jobs from the ready queue and run them until the pool is stopped.
+ * arg is the number of the worker.
+ */
+static void *worker_main(void *arg) {
+    metrics_thread((int)(long)arg + 1);
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (ready_head == ready_tail && !stopping) {
+            pthread_cond_wait(&work_ready, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+        job_t *job = &batch[ready[ready_head++ % WORKER_BATCH]];
+        pthread_mutex_unlock(&lock);
+
+        job->run(job->arg);
+
+        pthread_mutex_lock(&lock);
+        if (job->next != -1) {
+            push_ready(job->next);
+        }
+        if (--remaining == 0) {
+            pthread_cond_signal(&batch_done);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* Start count worker threads.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int start_workers(int count) {
+    for (num_threads = 0; num_threads < count; num_threads++) {
+        int err = pthread_create(&threads[num_threads], NULL, worker_main, (void *)(long)num_threads);
+        if (err != 0) {
+            fprintf(stderr, "Error: Cannot start worker thread: %s\n", strerror(err));
+            stop_workers();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Run the n jobs (at most WORKER_BATCH) of jobs on the workers, keeping
+ * the order of the jobs that share a key, and return when all are done.
+ */
+void run_jobs(job_t *jobs, int n) {
+    if (n == 0) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    batch = jobs;
+    remaining = n;
+    ready_head = ready_tail = 0;
+    for (int i = 0; i < n; i++) {
+        jobs[i].next = -1;
+        int j = i - 1;
+        while (j >= 0 && jobs[j].key != jobs[i].key) {
+            j--;
+        }
+        if (j >= 0) {
+            jobs[j].next = i;
+        } else {
+            push_ready(i);
+        }
+    }
+    pthread_cond_broadcast(&work_ready);
+    while (remaining > 0) {
+        pthread_cond_wait(&batch_done, &lock);
+    }
+    batch = NULL;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Stop the workers and wait for them to exit. No batch may be running.
+ */
+void stop_workers() {
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&lock);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    num_threads = 0;
+    stopping = 0;
+}
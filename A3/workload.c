@@ -0,0 +1,148 @@
+/* This code is provided solely for the personal and private use of students
+ * taking the CSC209H course at the University of Toronto. Copying for purposes
+ * other than this use is expressly prohibited. All forms of distribution of
+ * this code, including but not limited to public repositories on GitHub,
+ * GitLab, Bitbucket, or any other online platform, whether as given or with
+ * any changes, are expressly prohibited.
+ *
+ * Authors: Karen Reid, Paul He, Philip Kukulak
+ *
+ * All of the files in this directory and all subdirectories are:
+ * Copyright (c) 2025 Karen Reid
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "raid.h"
+
+/*
+ * This file generates synthetic workloads that are skewed the way real ones
+ * are, so that the cache tier and the write paths can be measured on more
+ * than uniform random blocks.
+ *
+ * The random accesses of a workload follow one of three distributions:
+ * uniform; Zipfian, where the block of popularity rank i is chosen with a
+ * weight of 1/i^theta; or a hotspot, where a fixed share of the accesses
+ * goes to a fixed share of the blocks. Popularity ranks are spread over the
+ * array by a stride that is coprime with its size, so the popular blocks
+ * are scattered over many stripes rather than packed into the first few.
+ *
+ * A share of the accesses instead continues one of several sequential
+ * streams, and a share of the writes covers several aligned blocks, which
+ * with large_blocks equal to the number of data disks is a whole stripe.
+ *
+ * Each workload draws from its own seed with rand_r, so two workloads with
+ * the same seed produce the same requests.
+ */
+
+/* Return the greatest common divisor of a and b.
+ */
+static long long gcd(long long a, long long b) {
+    while (b != 0) {
+        long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Return a random number in [0, 1) drawn from the seed of w.
+ */
+static double uniform(workload_t *w) {
+    return rand_r(&w->seed) / ((double)RAND_MAX + 1.0);
+}
+
+/* Set up w, whose description fields are filled in, to draw accesses to an
+ * array of num_blocks blocks. The Zipfian constants follow Gray et al.,
+ * "Quickly Generating Billion-Record Synthetic Databases", which draws a
+ * rank in constant time after summing the weights once.
+ *
+ * Returns 0 on success and -1 if the description is invalid.
+ */
+int init_workload(workload_t *w, int num_blocks) {
+    if (num_blocks <= 0 || w->theta < 0 || w->theta >= 1 || w->hot_pct <= 0 || w->hot_pct > 100
+            || w->hot_ops_pct < 0 || w->hot_ops_pct > 100 || w->seq_pct < 0 || w->seq_pct > 100
+            || w->streams <= 0 || w->streams > WORKLOAD_MAX_STREAMS || w->read_pct < 0 || w->read_pct > 100
+            || w->large_pct < 0 || w->large_pct > 100 || w->large_blocks <= 0) {
+        fprintf(stderr, "Error: Invalid workload description\n");
+        return -1;
+    }
+    w->num_blocks = num_blocks;
+
+    w->stride = (long long)(num_blocks * 0.6180339887) | 1;
+    while (gcd(w->stride, num_blocks) != 1) {
+        w->stride++;
+    }
+
+    if (w->dist == DIST_ZIPF) {
+        w->zeta_n = 0;
+        for (int i = 1; i <= num_blocks; i++) {
+            w->zeta_n += 1.0 / pow(i, w->theta);
+        }
+        w->zeta_2 = 1.0 + 1.0 / pow(2, w->theta);
+        w->alpha = 1.0 / (1.0 - w->theta);
+        w->eta = num_blocks > 2 ? (1.0 - pow(2.0 / num_blocks, 1.0 - w->theta)) / (1.0 - w->zeta_2 / w->zeta_n) : 1.0;
+    }
+
+    for (int s = 0; s < w->streams; s++) {
+        w->stream_next[s] = (long long)s * num_blocks / w->streams;
+    }
+    return 0;
+}
+
+/* Return the popularity rank of the next random access of w, where rank 0
+ * is the most popular block.
+ */
+static int next_rank(workload_t *w) {
+    int n = w->num_blocks;
+    double u = uniform(w);
+    switch (w->dist) {
+        case DIST_ZIPF: {
+            double uz = u * w->zeta_n;
+            if (uz < 1.0) {
+                return 0;
+            }
+            if (uz < w->zeta_2) {
+                return 1 % n;
+            }
+            int rank = (int)(n * pow(w->eta * u - w->eta + 1.0, w->alpha));
+            return rank < n ? rank : n - 1;
+        }
+        case DIST_HOTSPOT: {
+            int hot = (long long)n * w->hot_pct / 100 > 0 ? (long long)n * w->hot_pct / 100 : 1;
+            if (rand_r(&w->seed) % 100 < w->hot_ops_pct || hot == n) {
+                return (int)(uniform(w) * hot);
+            }
+            return hot + (int)(uniform(w) * (n - hot));
+        }
+        case DIST_UNIFORM:
+        default:
+            return (int)(u * n);
+    }
+}
+
+/* Draw the next request of w into op.
+ */
+void next_workload_op(workload_t *w, workload_op_t *op) {
+    int n = w->num_blocks;
+    op->write = rand_r(&w->seed) % 100 >= w->read_pct;
+    op->count = 1;
+    if (op->write && rand_r(&w->seed) % 100 < w->large_pct) {
+        op->count = w->large_blocks < n ? w->large_blocks : n;
+    }
+
+    if (rand_r(&w->seed) % 100 < w->seq_pct) {
+        int s = rand_r(&w->seed) % w->streams;
+        op->block = w->stream_next[s];
+        if (op->block + op->count > n) {
+            op->block = 0;
+        }
+        w->stream_next[s] = (op->block + op->count) % n;
+    } else {
+        op->block = (int)(next_rank(w) * w->stride % n);
+        op->block -= op->block % op->count;
+        if (op->block + op->count > n) {
+            op->count = n - op->block;
+        }
+    }
+}